@@ -0,0 +1,449 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+// Throughput benchmark for the PRC core, without PDAL.  A synthetic terrain
+// cloud, and optionally a terrain mesh, are written through oPRCFile and the
+// time of point ingest, double encoding, section deflate and finish() is
+// reported, best of --repeat runs.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include <prc/oPRCFile.hpp>
+#include <prc/PRCbitStream.hpp>
+#include <prc/PRCdeflate.hpp>
+#include <prc/PRCstats.hpp>
+
+namespace
+{
+
+enum class Distribution
+{
+    Uniform,
+    Skewed,
+    Height
+};
+
+struct Options
+{
+    Options() : points(1000000), meshSize(256), colors(256),
+        distribution(Distribution::Height), scale(0.01), repeat(3), seed(0),
+        level(PRC_DEFAULT_COMPRESSION), threads(1), streaming(false)
+    {}
+
+    uint64_t points;
+    uint32_t meshSize;
+    uint32_t colors;
+    Distribution distribution;
+    double scale;
+    unsigned repeat;
+    uint64_t seed;
+    int level;
+    unsigned threads;
+    bool streaming;
+    std::string output;
+};
+
+struct Cloud
+{
+    // Interleaved XYZ, grouped by colour: the points of colour k occupy
+    // triplets [offsets[k], offsets[k+1]).
+    std::vector<double> xyz;
+    std::vector<uint64_t> offsets;
+    std::vector<RGBAColour> palette;
+};
+
+struct Mesh
+{
+    std::vector<double> xyz;
+    std::vector<uint32_t> triangles;
+    std::vector<uint32_t> colorIndices;
+};
+
+// Stream buffer that only counts what is written to it.
+class CountingBuf : public std::streambuf
+{
+public:
+    CountingBuf() : m_count(0) {}
+    uint64_t count() const
+        { return m_count; }
+
+protected:
+    virtual int_type overflow(int_type c)
+    {
+        if (c != traits_type::eof())
+            m_count++;
+        return traits_type::not_eof(c);
+    }
+    virtual std::streamsize xsputn(const char *, std::streamsize n)
+    {
+        m_count += n;
+        return n;
+    }
+
+private:
+    uint64_t m_count;
+};
+
+const double Extent = 1000.0;
+
+double terrain(double x, double y)
+{
+    return 50.0 * std::sin(x / 100.0) * std::cos(y / 80.0) + x / 20.0;
+}
+
+double quantize(double v, double scale)
+{
+    return scale > 0 ? std::round(v / scale) * scale : v;
+}
+
+uint32_t colorOf(double z, double u, const Options& opts)
+{
+    uint32_t k = 0;
+    switch (opts.distribution)
+    {
+    case Distribution::Uniform:
+        k = static_cast<uint32_t>(u * opts.colors);
+        break;
+    case Distribution::Skewed:
+        // Cubing a uniform variate puts most points in the first colours.
+        k = static_cast<uint32_t>(u * u * u * opts.colors);
+        break;
+    case Distribution::Height:
+        // terrain() ranges over about [-50, 100].
+        k = static_cast<uint32_t>((z + 50.0) / 150.0 * opts.colors);
+        break;
+    }
+    return std::min(k, opts.colors - 1);
+}
+
+std::vector<RGBAColour> makePalette(uint32_t colors)
+{
+    std::vector<RGBAColour> palette(colors);
+    for (uint32_t k = 0; k < colors; ++k)
+    {
+        double t = colors > 1 ? k / double(colors - 1) : 0.0;
+        palette[k] = RGBAColour(t, 0.5 + 0.5 * std::sin(6.0 * t), 1.0 - t);
+    }
+    return palette;
+}
+
+Cloud makeCloud(const Options& opts, std::mt19937_64& rng)
+{
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> noise(0.0, 0.5);
+
+    std::vector<double> xyz(3 * opts.points);
+    std::vector<uint32_t> colors(opts.points);
+    for (uint64_t i = 0; i < opts.points; ++i)
+    {
+        double x = unit(rng) * Extent;
+        double y = unit(rng) * Extent;
+        double z = terrain(x, y) + noise(rng);
+        xyz[3*i+0] = quantize(x, opts.scale);
+        xyz[3*i+1] = quantize(y, opts.scale);
+        xyz[3*i+2] = quantize(z, opts.scale);
+        colors[i] = colorOf(z, unit(rng), opts);
+    }
+
+    Cloud cloud;
+    cloud.palette = makePalette(opts.colors);
+    cloud.offsets.assign(opts.colors + 1, 0);
+    for (uint32_t k : colors)
+        cloud.offsets[k + 1]++;
+    for (uint32_t k = 0; k < opts.colors; ++k)
+        cloud.offsets[k + 1] += cloud.offsets[k];
+
+    std::vector<uint64_t> next(cloud.offsets.begin(), cloud.offsets.end() - 1);
+    cloud.xyz.resize(xyz.size());
+    for (uint64_t i = 0; i < opts.points; ++i)
+        std::memcpy(cloud.xyz.data() + 3 * next[colors[i]]++,
+            xyz.data() + 3 * i, 3 * sizeof(double));
+    return cloud;
+}
+
+Mesh makeMesh(const Options& opts, std::mt19937_64& rng)
+{
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    const uint32_t n = opts.meshSize;
+
+    Mesh mesh;
+    mesh.xyz.resize(3 * std::size_t(n) * n);
+    std::vector<uint32_t> vertexColors(std::size_t(n) * n);
+    for (uint32_t j = 0; j < n; ++j)
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            std::size_t v = std::size_t(j) * n + i;
+            double x = Extent * i / (n - 1);
+            double y = Extent * j / (n - 1);
+            double z = terrain(x, y);
+            mesh.xyz[3*v+0] = quantize(x, opts.scale);
+            mesh.xyz[3*v+1] = quantize(y, opts.scale);
+            mesh.xyz[3*v+2] = quantize(z, opts.scale);
+            vertexColors[v] = colorOf(z, unit(rng), opts);
+        }
+
+    for (uint32_t j = 0; j + 1 < n; ++j)
+        for (uint32_t i = 0; i + 1 < n; ++i)
+        {
+            const uint32_t v = j * n + i;
+            const uint32_t quad[2][3] = { { v, v + 1, v + n },
+                { v + 1, v + n + 1, v + n } };
+            for (int t = 0; t < 2; ++t)
+                for (int c = 0; c < 3; ++c)
+                {
+                    mesh.triangles.push_back(quad[t][c]);
+                    mesh.colorIndices.push_back(vertexColors[quad[t][c]]);
+                }
+        }
+    return mesh;
+}
+
+double seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+struct Result
+{
+    Result() : time(1e300), bytesIn(0), bytesOut(0) {}
+
+    void add(double t, uint64_t in, uint64_t out)
+    {
+        if (t < time)
+            time = t;
+        bytesIn = in;
+        bytesOut = out;
+    }
+
+    double time;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+};
+
+void report(const char *name, const Result& r, uint64_t items,
+    const char *unit)
+{
+    printf("%-10s %10.4f %12.1f %10.2f", name, r.time,
+        r.bytesIn / 1048576.0 / r.time,
+        r.bytesOut ? double(r.bytesIn) / r.bytesOut : 0.0);
+    if (items)
+        printf(" %12.0f %s/s", items / r.time, unit);
+    printf("\n");
+}
+
+void usage()
+{
+    std::cerr <<
+        "usage: prc_bench [options]\n"
+        "  --points N         points in the cloud (1000000)\n"
+        "  --mesh-size N      vertices along each side of the mesh, 0 for\n"
+        "                     no mesh (256)\n"
+        "  --colors N         colours, one point set each (256)\n"
+        "  --distribution D   uniform, skewed or height (height)\n"
+        "  --scale S          coordinate quantum, 0 for none (0.01)\n"
+        "  --repeat N         runs; the best time is reported (3)\n"
+        "  --seed N           random seed (0)\n"
+        "  --output FILE      keep the PRC file written by the last run\n"
+        "  --level N          deflate level, -1 for the default (-1)\n"
+        "  --threads N        threads used to compress (1)\n"
+        "  --streaming        deflate sections while they are serialized\n";
+}
+
+bool parseArgs(int argc, char *argv[], Options& opts)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg(argv[i]);
+        if (arg == "--streaming")
+        {
+            opts.streaming = true;
+            continue;
+        }
+        if (arg == "--help" || arg == "-h" || i + 1 == argc)
+            return false;
+        std::string value(argv[++i]);
+        if (arg == "--points")
+            opts.points = std::strtoull(value.c_str(), NULL, 10);
+        else if (arg == "--mesh-size")
+            opts.meshSize = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--colors")
+            opts.colors = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--distribution")
+        {
+            if (value == "uniform")
+                opts.distribution = Distribution::Uniform;
+            else if (value == "skewed")
+                opts.distribution = Distribution::Skewed;
+            else if (value == "height")
+                opts.distribution = Distribution::Height;
+            else
+                return false;
+        }
+        else if (arg == "--scale")
+            opts.scale = std::strtod(value.c_str(), NULL);
+        else if (arg == "--repeat")
+            opts.repeat = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--seed")
+            opts.seed = std::strtoull(value.c_str(), NULL, 10);
+        else if (arg == "--level")
+            opts.level = std::atoi(value.c_str());
+        else if (arg == "--threads")
+            opts.threads = std::strtoul(value.c_str(), NULL, 10);
+        else if (arg == "--output")
+            opts.output = value;
+        else
+            return false;
+    }
+    return opts.colors > 0 && opts.repeat > 0 && opts.meshSize != 1 &&
+        opts.threads > 0 &&
+        opts.level >= PRC_DEFAULT_COMPRESSION &&
+        opts.level <= PRCDeflateMaxLevel() &&
+        opts.points <= UINT32_MAX && opts.meshSize < 65536;
+}
+
+} // unnamed namespace
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    if (!parseArgs(argc, argv, opts))
+    {
+        usage();
+        return 1;
+    }
+
+    std::mt19937_64 rng(opts.seed);
+    Cloud cloud = makeCloud(opts, rng);
+    Mesh mesh;
+    if (opts.meshSize > 0)
+        mesh = makeMesh(opts, rng);
+    const uint64_t cloudBytes = cloud.xyz.size() * sizeof(double);
+    const uint64_t numTriangles = mesh.triangles.size() / 3;
+
+    printf("points %llu, mesh triangles %llu, colors %u\n",
+        (unsigned long long)opts.points, (unsigned long long)numTriangles,
+        opts.colors);
+    printf("deflate %s, level %d%s, %u threads\n", PRCDeflateBackend(),
+        opts.level, opts.streaming ? ", streaming" : "", opts.threads);
+
+    Result ingest, encode, deflate, finish;
+    PRCStats stats;
+    for (unsigned run = 0; run < opts.repeat; ++run)
+    {
+        // Double encoding and deflate of the cloud's coordinates on their
+        // own, as they are written into a section.
+        uint8_t *data = NULL;
+        {
+            PRCbitStream out(data, 0);
+            out.setCompressionLevel(opts.level);
+            out.setCompressionThreads(opts.threads);
+            if (opts.streaming)
+                out.enableStreamingCompression();
+            auto start = std::chrono::steady_clock::now();
+            for (double v : cloud.xyz)
+                out << v;
+            encode.add(seconds(start), cloudBytes, out.getSize());
+
+            const uint64_t encoded = out.getSize();
+            start = std::chrono::steady_clock::now();
+            out.compress();
+            deflate.add(seconds(start), encoded, out.getSize());
+        }
+        free(data);
+
+        // The whole file.
+        CountingBuf counter;
+        std::ostream discard(&counter);
+        std::ofstream file;
+        const bool keep = !opts.output.empty() && run + 1 == opts.repeat;
+        if (keep)
+            file.open(opts.output.c_str(), std::ios::out | std::ios::binary);
+        oPRCFile prc(keep ? static_cast<std::ostream&>(file) : discard, 1000);
+        prc.setCompressionLevel(opts.level);
+        prc.setThreads(opts.threads);
+        if (opts.streaming)
+            prc.enableStreamingCompression();
+
+        auto start = std::chrono::steady_clock::now();
+        prc.begingroup("points");
+        for (uint32_t k = 0; k < opts.colors; ++k)
+            prc.addPoints(static_cast<uint32_t>(cloud.offsets[k + 1] -
+                cloud.offsets[k]), cloud.xyz.data() + 3 * cloud.offsets[k],
+                cloud.palette[k], 1.0);
+        prc.endgroup();
+        if (numTriangles)
+        {
+            PRCmaterial material(RGBAColour(0.1, 0.1, 0.1),
+                RGBAColour(1.0, 1.0, 1.0), RGBAColour(0.0, 0.0, 0.0),
+                RGBAColour(0.1, 0.1, 0.1), 1.0, 0.1);
+            prc.begingroup("mesh");
+            prc.addTriangles(static_cast<uint32_t>(mesh.xyz.size() / 3),
+                reinterpret_cast<const double (*)[3]>(mesh.xyz.data()),
+                static_cast<uint32_t>(numTriangles),
+                reinterpret_cast<const uint32_t (*)[3]>(
+                    mesh.triangles.data()),
+                material, 0, NULL, NULL, 0, NULL, NULL,
+                static_cast<uint32_t>(cloud.palette.size()),
+                cloud.palette.data(),
+                reinterpret_cast<const uint32_t (*)[3]>(
+                    mesh.colorIndices.data()),
+                0, NULL, NULL, 25.8419);
+            prc.endgroup();
+        }
+        ingest.add(seconds(start), cloudBytes + mesh.xyz.size() *
+            sizeof(double), 0);
+
+        start = std::chrono::steady_clock::now();
+        prc.finish();
+        finish.add(seconds(start), cloudBytes + mesh.xyz.size() *
+            sizeof(double), keep ? prc.header.file_size : counter.count());
+        if (run + 1 == opts.repeat)
+            stats = prc.stats;
+    }
+
+    printf("\n%-10s %10s %12s %10s %12s\n", "phase", "best s", "MiB/s in",
+        "ratio", "rate");
+    report("ingest", ingest, opts.points + numTriangles, "item");
+    report("encode", encode, cloud.xyz.size(), "double");
+    report("deflate", deflate, 0, "");
+    report("finish", finish, opts.points + numTriangles, "item");
+
+    printf("\n%-24s %6s %9s %9s %11s %11s\n", "last finish()", "calls",
+        "wall s", "cpu s", "in MiB", "out MiB");
+    for (const auto& phase : stats.phases())
+    {
+        const PRCPhaseStats& ps = phase.second;
+        printf("%-24s %6u %9.4f %9.4f %11.2f %11.2f\n", phase.first.c_str(),
+            ps.calls, ps.wall_time, ps.cpu_time, ps.bytes_in / 1048576.0,
+            ps.bytes_out / 1048576.0);
+    }
+    printf("peak resident %.1f MiB\n", PRCStats::peakRss() / 1048576.0);
+    return 0;
+}
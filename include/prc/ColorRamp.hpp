@@ -0,0 +1,95 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <prc/oPRCFile.hpp>
+
+namespace pdal
+{
+
+/**
+ * Sequential colour ramp with an arbitrary number of classes.
+ *
+ * The palette is given as a list of anchor colours ordered from the low to
+ * the high end of the ramp and is linearly interpolated to the requested
+ * class count.  A ramp with N classes keeps N-1 ascending thresholds; a value
+ * v falls into class k when exactly k thresholds are less than or equal to v.
+ */
+class ColorRamp
+{
+public:
+    ColorRamp(const std::vector<RGBAColour>& anchors, std::size_t numClasses);
+
+    static std::vector<RGBAColour> oranges();
+    static std::vector<RGBAColour> blueGreen();
+
+    // Thresholds evenly spaced in value or in sqrt(value) over [lo, hi].
+    // With lo < 0, sqrt(value - lo) is used instead.
+    void setLinear(double lo, double hi);
+    void setSqrt(double lo, double hi);
+
+    // Thresholds that put an equal share of the values counted in hist, a
+    // histogram of equal-width bins over [lo, hi], into every class.
+    void setEqualized(const std::vector<uint64_t>& hist, double lo,
+        double hi);
+
+    // Value below which a fraction q of the values counted in hist lie,
+    // interpolated linearly within its bin.
+    static double quantile(const std::vector<uint64_t>& hist, double lo,
+        double hi, double q);
+
+    // Add d to every threshold, e.g. to move them into a centred frame.
+    void translate(double d);
+
+    std::size_t size() const
+        { return m_colours.size(); }
+    const RGBAColour& colour(std::size_t cls) const
+        { return m_colours[cls]; }
+    const std::vector<RGBAColour>& colours() const
+        { return m_colours; }
+    const std::vector<double>& thresholds() const
+        { return m_thresholds; }
+
+    // Branchless binary search over the threshold table.
+    uint16_t classify(double v) const
+    {
+        const double *base = m_thresholds.data();
+        std::size_t n = m_thresholds.size();
+        if (n == 0)
+            return 0;
+        while (n > 1)
+        {
+            const std::size_t half = n / 2;
+            base = (base[half] <= v) ? base + half : base;
+            n -= half;
+        }
+        return static_cast<uint16_t>((base - m_thresholds.data()) +
+            (*base <= v));
+    }
+
+private:
+    std::vector<RGBAColour> m_colours;
+    std::vector<double> m_thresholds;
+};
+
+}  // namespace pdal
@@ -0,0 +1,63 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+namespace pdal
+{
+
+/**
+ * Level-of-detail assignment over an octree.
+ *
+ * Level k of the tree samples the cloud on a grid of cubic cells with edge
+ * spacing / 2^k, anchored at the minimum corner of the bounds.  Points are
+ * visited in input order and each one is kept at the coarsest level whose
+ * cell holding it is still empty; points that find no empty cell go to the
+ * last level.  Drawing levels 0..k therefore gives a subsample of the cloud
+ * with roughly uniform density, finer as k grows.
+ */
+class OctreeBuilder
+{
+public:
+    // Cells are indexed with this many bits per axis.
+    static const unsigned CellBits = 21;
+
+    OctreeBuilder(const double min[3], double spacing, unsigned levels);
+
+    unsigned levels() const
+        { return m_levels; }
+
+    // Level of the point at xyz.  Must be called for the points in the order
+    // in which coarse levels should be filled.
+    uint8_t insert(const double *xyz);
+
+private:
+    double m_min[3];
+    double m_spacing;
+    unsigned m_levels;
+
+    // Occupied cells of each sampled level (all but the last).
+    std::vector<std::unordered_set<uint64_t>> m_cells;
+};
+
+} // namespace pdal
@@ -40,24 +40,54 @@ typedef unsigned long uint32_t;
 #include <iostream>
 #include <stdlib.h>
 
+#include <prc/PRCdeflate.hpp>
+
 #define CHUNK_SIZE (1024)
 // Is this a reasonable initial size?
+#define DEFLATE_WINDOW (256*1024)
+// Uncompressed bytes held by a stream compressed as it is written
 
 class PRCbitStream
 {
   public:
-    PRCbitStream(uint8_t*& buff, unsigned int l) : byteIndex(0), bitIndex(0),
-                 allocatedLength(l), data(buff), compressed(false)
+    PRCbitStream(uint8_t*& buff, unsigned int l) : bitBuffer(0), bitCount(0),
+                 byteIndex(0), allocatedLength(l), data(buff), compressed(false),
+                 compressionLevel(PRC_DEFAULT_COMPRESSION), compressionThreads(1),
+                 deflater(NULL), drainedBytes(0)
     {
       if(data == 0)
-      {
         getAChunk();
-      }
+      while(allocatedLength < byteIndex+9)
+        getAChunk();
     }
 
+    ~PRCbitStream();
+
+    // Size in bytes, counting the byte being filled.  Writing more than
+    // MaxStreamBytes throws std::length_error.
     unsigned int getSize() const;
+    // Not available once streaming compression has started.
     uint8_t* getData();
 
+    // Deflate the stream while it is written: whenever DEFLATE_WINDOW bytes
+    // have collected they are passed to zlib and the buffer is reused, so
+    // the whole section never exists uncompressed.  compress() then only
+    // finishes the deflate stream.  The compressed bytes are the same.
+    // Does nothing if the deflate backend cannot stream.
+    void enableStreamingCompression();
+    // Level for compress(), PRC_DEFAULT_COMPRESSION for the backend's own.
+    // Set it before streaming compression is enabled.
+    void setCompressionLevel(int level) { compressionLevel = level; }
+    // Threads compress() may use; see PRCDeflate().  Streaming compression
+    // always uses one.
+    void setCompressionThreads(unsigned threads) { compressionThreads = threads; }
+
+    // Allocate room for about bytes at once, so that a large stream is not
+    // grown by doubling and copying.  A streaming buffer keeps its window.
+    void setSizeHint(size_t bytes);
+    // Free the compressed bytes once they have been written.
+    void release();
+
     PRCbitStream& operator <<(const std::string&);
     PRCbitStream& operator <<(bool);
     PRCbitStream& operator <<(uint32_t);
@@ -66,21 +96,94 @@ class PRCbitStream
     PRCbitStream& operator <<(double);
     PRCbitStream& operator <<(const char*);
 
+    // Arrays of doubles, of unsigned integers and of points given as
+    // interleaved x, y and z, written as by operator<< one element at a time.
+    // Runs of equal values are encoded once.
+    void writeDoubles(const double *values, size_t n);
+    void writeUnsignedIntegers(const uint32_t *values, size_t n);
+    void writeVector3ds(const double *xyz, size_t n);
+
     void compress();
     void write(std::ostream &out) const;
+    // Largest size getSize() can report.
+    static const uint64_t MaxStreamBytes = 0xFFFFFFFFu;
   private:
-    void writeBit(bool);
-    void writeBits(uint32_t,uint8_t);
-    void writeByte(uint8_t);
-    void nextByte();
-    void nextBit();
+    // The last double written and, once it repeats, its encoded bits.
+    struct BitRun
+    {
+      BitRun() : value(0), valid(false), encoded(false)
+      {
+        word[0] = word[1] = 0;
+        bits[0] = bits[1] = 0;
+      }
+      uint64_t word[2];
+      unsigned int bits[2];
+      double value;
+      bool valid;
+      bool encoded;
+    };
+
+    void writeBit(bool b) { writeBits(b,1); }
+    inline void writeBits(uint32_t,uint8_t);
+    void writeByte(uint8_t u) { writeBits(u,8); }
+    inline void appendBits(uint64_t,unsigned int);
+    void writeDoubleRun(double value, BitRun &run, PRCbitStream &scratch);
+    void takeBits(BitRun &run);
+    void drain();
+    void flushWord();
+    void sync();
     void getAChunk();
-    // bitIndex is "big endian", zero based, location of next bit to write
-    unsigned int byteIndex,bitIndex;
-    unsigned int allocatedLength;
+    void tooLarge() const;
+    void writeAfterCompress() const;
+    // Bits not yet in data, the most recent in the least significant bits.
+    // They are stored a whole 64-bit word at a time, so data always holds
+    // byteIndex complete bytes and is kept at least byteIndex+9 long: room
+    // for one more word and the partial byte sync() may leave after it.
+    uint64_t bitBuffer;
+    unsigned int bitCount;
+    size_t byteIndex;
+    size_t allocatedLength;
     uint8_t*& data;
     bool compressed;
     uint32_t compressedDataSize;
+    int compressionLevel;
+    unsigned compressionThreads;
+    // Streaming compression: the deflate stream and the number of bytes it
+    // has been given.
+    PRCDeflateStream *deflater;
+    uint64_t drainedBytes;
+
+    PRCbitStream(const PRCbitStream&);
+    PRCbitStream& operator=(const PRCbitStream&);
 };
 
+// Append the low bits bits of u, most significant first.
+inline void PRCbitStream::writeBits(uint32_t u, uint8_t bits)
+{
+  if(compressed)
+  {
+    writeAfterCompress();
+    return;
+  }
+  if(bits == 0 || bits > 32)
+    return;
+  appendBits(u & (0xFFFFFFFFu >> (32-bits)),bits);
+}
+
+// Append bits bits, at most 64, of value, which has no other bits set.
+inline void PRCbitStream::appendBits(uint64_t value, unsigned int bits)
+{
+  if(bitCount+bits < 64)
+  {
+    bitBuffer = (bitBuffer << bits) | value;
+    bitCount += bits;
+    return;
+  }
+  const unsigned int rest = bitCount+bits-64;
+  bitBuffer = (bitCount ? bitBuffer << (64-bitCount) : 0) | (value >> rest);
+  flushWord();
+  bitBuffer = value & ((uint64_t(1) << rest)-1);
+  bitCount = rest;
+}
+
 #endif // __PRC_BIT_STREAM_H
@@ -0,0 +1,75 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Deflate implementation used for PRC sections and pictures.  The backend is
+// picked when the library is built: zlib by default, or zlib-ng's native API
+// (PRC_WITH_ZLIB_NG) or libdeflate (PRC_WITH_LIBDEFLATE).  All of them write
+// zlib streams; the bytes differ between backends and levels, but any
+// inflater reads them.
+
+#define PRC_DEFAULT_COMPRESSION (-1)
+// Input split off for each thread when compressing in parallel
+#define PRC_DEFLATE_BLOCK (128*1024)
+
+// Name of the backend, e.g. "zlib 1.2.13".
+const char *PRCDeflateBackend();
+
+// Highest compression level the backend accepts: 9, or 12 for libdeflate.
+int PRCDeflateMaxLevel();
+
+// Compress size bytes at in at level 0 to PRCDeflateMaxLevel(), or
+// PRC_DEFAULT_COMPRESSION.  Returns a buffer from malloc() holding the
+// compressed_size bytes of the zlib stream, or NULL on failure.
+//
+// With more than one thread the input is cut into PRC_DEFLATE_BLOCK blocks
+// that are compressed concurrently, as pigz does: each block is deflated on
+// its own, primed with the 32 KiB of input before it, and the pieces are
+// joined into one zlib stream.  It is a little larger and not the same bytes
+// as the single-threaded one.  libdeflate always uses one thread.
+uint8_t *PRCDeflate(const uint8_t *in, size_t size, int level,
+                    size_t &compressed_size, unsigned threads=1);
+
+// Incremental compression, for streams deflated while they are written.
+// libdeflate only compresses whole buffers, so it has none.
+class PRCDeflateStream
+{
+public:
+  static bool available();
+
+  explicit PRCDeflateStream(int level);
+  ~PRCDeflateStream();
+
+  // Compress size more bytes; finish ends the stream.
+  void write(const uint8_t *in, size_t size, bool finish);
+  // Hand over the compressed bytes, a buffer from malloc().
+  uint8_t *release(size_t &compressed_size);
+
+private:
+  void *stream;
+  uint8_t *out;
+  size_t out_size;
+  size_t out_length;
+
+  PRCDeflateStream(const PRCDeflateStream&);
+  PRCDeflateStream& operator=(const PRCDeflateStream&);
+};
@@ -0,0 +1,57 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small pool of worker threads that run jobs in the order they are pushed.
+// With no workers, push() runs each job at once on the calling thread.
+class PRCJobQueue
+{
+public:
+  explicit PRCJobQueue(unsigned workers);
+  // Waits for every job pushed.
+  ~PRCJobQueue();
+
+  void push(const std::function<void()> &job);
+  // Return once every job pushed so far has finished.  If a job threw,
+  // rethrow the first exception.
+  void wait();
+
+private:
+  void work();
+
+  std::mutex mutex;
+  std::condition_variable job_ready;
+  std::condition_variable job_done;
+  std::deque<std::function<void()> > jobs;
+  std::exception_ptr error;
+  unsigned running;
+  bool stopping;
+  std::vector<std::thread> threads;
+
+  PRCJobQueue(const PRCJobQueue&);
+  PRCJobQueue& operator=(const PRCJobQueue&);
+};
@@ -0,0 +1,83 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Totals for one phase of writing a PRC file.  Times are in seconds; CPU
+// time is user plus system time of the whole process, so it includes every
+// thread.  peak_rss is the process' resident high-water mark, in bytes, when
+// the phase last ended.
+struct PRCPhaseStats
+{
+  PRCPhaseStats() :
+    calls(0), wall_time(0), cpu_time(0), bytes_in(0), bytes_out(0),
+    peak_rss(0) {}
+  uint32_t calls;
+  double wall_time;
+  double cpu_time;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  uint64_t peak_rss;
+};
+
+class PRCStats
+{
+public:
+  // Phases in the order they were first recorded.
+  typedef std::vector<std::pair<std::string, PRCPhaseStats> > PhaseList;
+
+  // Totals of the named phase, added if it is new.
+  PRCPhaseStats& phase(const std::string &name);
+  const PhaseList& phases() const { return phase_list; }
+  // Add the totals of other, e.g. kept by another thread, to these.
+  void add(const PRCStats &other);
+
+  static double cpuTime();
+  static uint64_t peakRss();
+
+private:
+  PhaseList phase_list;
+};
+
+// Adds the time from construction to destruction to a phase of stats.  A
+// null stats makes the timer a no-op.
+class PRCPhaseTimer
+{
+public:
+  PRCPhaseTimer(PRCStats *stats, const std::string &name,
+                uint64_t bytes_in=0);
+  ~PRCPhaseTimer();
+  void setBytesOut(uint64_t bytes) { bytes_out = bytes; }
+
+private:
+  PRCStats *stats;
+  std::string name;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  std::chrono::steady_clock::time_point wall_start;
+  double cpu_start;
+
+  PRCPhaseTimer(const PRCPhaseTimer&);
+  PRCPhaseTimer& operator=(const PRCPhaseTimer&);
+};
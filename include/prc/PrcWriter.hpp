@@ -18,15 +18,21 @@
 
 #pragma once
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <random>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <hpdf.h>
 
 #include <prc/oPRCFile.hpp>
 
+#include <pdal/DimType.hpp>
 #include <pdal/pdal_export.hpp>
+#include <pdal/Streamable.hpp>
 #include <pdal/Writer.hpp>
 
 namespace
@@ -56,17 +62,41 @@ enum CONTRAST_STRETCH
     CONTRAST_STRETCH_SQRT
 };
 
-class PDAL_DLL PrcWriter : public Writer
+class PDAL_DLL PrcWriter : public Writer, public Streamable
 {
 public:
-    PrcWriter()
-    {}
+    PrcWriter() : m_haveColor(false), m_pointCount(0), m_colorShift(0),
+        m_detectColorBits(false), m_colorDim(Dimension::Id::Z),
+        m_haveValues(false), m_valueIsInteger(false), m_valueMin(0.0),
+        m_valueMax(0.0), m_haveCenter(false), m_cx(0.0), m_cy(0.0), m_cz(0.0),
+        m_packedSize(0), m_valueOffset(0), m_sampled(0), m_streamed(0),
+        m_streamCpu(0.0), m_streamBatches(false)
+    {
+        m_snapStep[0] = m_snapStep[1] = m_snapStep[2] = 0.0;
+    }
 
     static void * create();
     static int32_t destroy(void *);
     std::string getName() const;
 
 private:
+    // With the default spacing, the finest sampled level of the deepest tree
+    // still fits the octree's cell index.
+    static const unsigned MaxOctreeLevels = 15;
+    // Every tile costs a group and a set of counters per binning thread.
+    static const unsigned MaxTiles = 65536;
+    // Bins, tiles times octree levels times colours, the points may be
+    // spread over.  Each binning thread keeps a counter per bin.
+    static const std::size_t MaxBins = std::size_t(1) << 22;
+    // Largest value range of an integer colour dimension classified through
+    // a lookup table.
+    static const int MaxValueLut = 65536;
+    // Bins of the histogram behind the equalize and percentile stretches.
+    static const std::size_t HistogramBins = 4096;
+    // Default number of points a streamed read buffers before binning them,
+    // when nothing the binning needs depends on the whole cloud.
+    static const point_count_t StreamBatch = point_count_t(1) << 22;
+
     enum class OutputFormat
     {
         Pdf,
@@ -83,23 +113,190 @@ private:
     enum class ContrastStretch
     {
         Linear,
-        Sqrt
+        Sqrt,
+        Equalize,
+        Percentile
+    };
+
+    enum class ColorPalette
+    {
+        MedianCut,
+        Rgb332,
+        Rgb444
+    };
+
+    enum class VoxelMethod
+    {
+        First,
+        Centroid
+    };
+
+    struct VoxelKey
+    {
+        int64_t x;
+        int64_t y;
+        int64_t z;
+        uint16_t color;
+
+        bool operator==(const VoxelKey& other) const
+        {
+            return x == other.x && y == other.y && z == other.z &&
+                color == other.color;
+        }
+    };
+
+    // Groups the points being flushed are written to: an XY grid of tiles,
+    // each holding numLevels octree levels.
+    struct GroupLayout
+    {
+        unsigned tilesX;
+        unsigned tilesY;
+        unsigned numLevels;
+
+        unsigned numTiles() const
+            { return tilesX * tilesY; }
+    };
+
+    struct VoxelKeyHash
+    {
+        std::size_t operator()(const VoxelKey& key) const
+        {
+            // Large odd multipliers spread neighbouring cells across buckets.
+            uint64_t h = static_cast<uint64_t>(key.x) * 0x9E3779B97F4A7C15ULL;
+            h ^= static_cast<uint64_t>(key.y) * 0xC2B2AE3D27D4EB4FULL;
+            h ^= static_cast<uint64_t>(key.z) * 0x165667B19E3779F9ULL;
+            h ^= key.color;
+            return static_cast<std::size_t>(h ^ (h >> 29));
+        }
     };
 
     virtual void initialize();
     virtual void addArgs(ProgramArgs& args);
     virtual void ready(PointTableRef table);
     virtual void write(const PointViewPtr view);
+    virtual bool processOne(PointRef& point);
     virtual void done(PointTableRef table);
 
+    void flushPoints();
+    void publishStats();
+    void appendPacked(point_count_t count);
+    void appendVoxels(point_count_t count);
+    void samplePoints(point_count_t first, point_count_t& seen);
+    uint16_t colorKey(const uint16_t rgb[3]);
+    void widenColors();
+    void buildPalette(std::vector<uint16_t>& lut,
+        std::vector<RGBAColour>& palette);
+    void findHeaderCenter(MetadataNode root);
+    void findSourceScale(MetadataNode root);
+    static double snapStep(double limit);
+    void snapPoints();
+    std::vector<uint64_t> valueHistogram(double lo, double hi, double cz);
+    void centerPoints(double cx, double cy, double cz);
+    template<typename Classify>
+    std::vector<std::vector<PRCVector3d>> binPoints(Classify classify,
+        std::size_t numBins);
+    void addBinnedPoints(const GroupLayout& layout,
+        std::vector<std::vector<PRCVector3d>>& binned,
+        const std::vector<RGBAColour>& colors, double width);
+    std::size_t maxColors() const;
+    void checkBins(std::size_t numTiles, std::size_t numColors) const;
+    unsigned sliceCount(point_count_t numPoints,
+        std::size_t numCounters = 0) const;
+    std::vector<uint8_t> buildLevels(double cx, double cy, double cz);
+    void beginGroup(const GroupLayout& layout, unsigned tile, unsigned lod);
+    void endGroup(const GroupLayout& layout, unsigned lod);
+
     std::unique_ptr<oPRCFile> m_prcFile;
     // std::string m_prcFilename;
     std::string m_pdfFilename;
     BOX3D m_bounds;
 
+    // Points received but not yet binned into PRC point sets.  Coordinates
+    // are stored uncentred as interleaved XYZ triplets; colours, when points
+    // are coloured from their RGB, are stored as 15-bit keys (see RGB() in
+    // ColorQuantizer.hpp).
+    std::vector<double> m_xyz;
+    std::vector<uint16_t> m_colors;
+    bool m_haveColor;
+
+    // Points binned so far.
+    point_count_t m_pointCount;
+
+    // Right shift taking RGB components to 8 bits, and whether it is still
+    // being detected from the components seen (see colorKey()).
+    int m_colorShift;
+    bool m_detectColorBits;
+
+    // Values of the colour dimension when a colour ramp is applied to a
+    // dimension other than Z, with their range over the points buffered.
+    std::vector<double> m_values;
+    Dimension::Id m_colorDim;
+    bool m_haveValues;
+    bool m_valueIsInteger;
+    double m_valueMin;
+    double m_valueMax;
+
+    // Centre taken from the reader's header, applied as points arrive.
+    bool m_haveCenter;
+    double m_cx;
+    double m_cy;
+    double m_cz;
+
+    // Per-axis step centred coordinates are rounded to, or 0 not to snap.
+    double m_snapStep[3];
+
+    // Scratch space for packed point reads: XYZ as doubles, followed by
+    // RGB as uint16 when the input has colour and then the colour dimension
+    // as a double when m_haveValues is set.
+    DimTypeList m_packedDims;
+    std::size_t m_packedSize;
+    std::size_t m_valueOffset;
+    std::vector<char> m_packed;
+
+    // Occupied voxels, mapped to the index of the point kept for each.  The
+    // counts are kept only for centroid decimation.
+    std::unordered_map<VoxelKey, point_count_t, VoxelKeyHash> m_voxels;
+    std::vector<uint32_t> m_voxelCounts;
+
+    // Reservoir sampling state for max_points: points offered so far and
+    // the generator that picks the slots they replace.
+    point_count_t m_sampled;
+    std::mt19937_64 m_rng;
+
+    // Points taken by processOne() and when reading began.  A streamed read
+    // is timed as a whole, from ready() to done(), batches binned on the way
+    // included.
+    point_count_t m_streamed;
+    std::chrono::steady_clock::time_point m_streamStart;
+    double m_streamCpu;
+    // Whether processOne() bins every m_streamBatch points as they arrive.
+    bool m_streamBatches;
+
     OutputFormat m_outputFormat;
     ColorScheme m_colorScheme;
     ContrastStretch m_contrastStretch;
+    std::string m_colorDimName;
+    double m_clipPercent;
+    uint16_t m_colorClasses;
+    unsigned m_threads;
+    uint64_t m_pointSetMemoryLimit;
+    bool m_streamCompression;
+    int m_compressionLevel;
+    bool m_mergeViews;
+    bool m_headerCenter;
+    double m_voxelSize;
+    VoxelMethod m_voxelMethod;
+    unsigned m_octreeLevels;
+    double m_octreeSpacing;
+    point_count_t m_maxPoints;
+    uint64_t m_seed;
+    double m_tileSize;
+    unsigned m_tileCount;
+    unsigned m_colorBits;
+    ColorPalette m_colorPalette;
+    bool m_snap;
+    double m_snapTolerance;
+    point_count_t m_streamBatch;
 
     HPDF_REAL m_fov;
     HPDF_REAL m_coox;
@@ -118,6 +315,10 @@ private:
     friend std::istream& operator>>(std::istream& in, ContrastStretch& fmt);
     friend std::ostream& operator<<(std::ostream& out,
         const ContrastStretch& fmt);
+    friend std::istream& operator>>(std::istream& in, ColorPalette& cp);
+    friend std::ostream& operator<<(std::ostream& out, const ColorPalette& cp);
+    friend std::istream& operator>>(std::istream& in, VoxelMethod& vm);
+    friend std::ostream& operator<<(std::ostream& out, const VoxelMethod& vm);
 
     PrcWriter& operator=(const PrcWriter&) = delete;
     PrcWriter(const PrcWriter&) = delete;
@@ -45,6 +45,7 @@
 
 #include <prc/PRC.hpp>
 #include <prc/PRCbitStream.hpp>
+#include <prc/PRCstats.hpp>
 #include <prc/writePRC.hpp>
 
 class oPRCFile;
@@ -484,7 +485,8 @@ class PRCUncompressedFile
   public:
     PRCUncompressedFile() : file_size(0), data(NULL) {}
     PRCUncompressedFile(uint32_t fs, uint8_t *d) : file_size(fs), data(d) {}
-    ~PRCUncompressedFile() { if(data != NULL) delete[] data; }
+    // data is from malloc() and owned by the file
+    ~PRCUncompressedFile() { free(data); }
     uint32_t file_size;
     uint8_t *data;
 
@@ -531,6 +533,7 @@ class PRCFileStructure : public PRCStartHeader
     double unit;
     PRCTopoContextList contexts;
     PRCTessList tessellations;
+    int compression_level;
 
     uint32_t sizes[6];
     uint8_t *globals_data;
@@ -568,13 +571,33 @@ class PRCFileStructure : public PRCStartHeader
       tessellation_chord_height_ratio(2000.0),tessellation_angle_degree(40.0),
       default_font_family_name(""),
       unit(1),
+      compression_level(PRC_DEFAULT_COMPRESSION),
       globals_data(NULL),globals_out(globals_data,0),
       tree_data(NULL),tree_out(tree_data,0),
       tessellations_data(NULL),tessellations_out(tessellations_data,0),
       geometry_data(NULL),geometry_out(geometry_data,0),
       extraGeometry_data(NULL),extraGeometry_out(extraGeometry_data,0) {}
     void write(std::ostream&);
-    void prepare();
+    // Serialize and compress the sections on up to threads threads, which
+    // the section workers and the block deflate of large sections share.
+    void prepare(PRCStats *stats=NULL, unsigned threads=1);
+    void setCompressionLevel(int level)
+    {
+      compression_level = level;
+      globals_out.setCompressionLevel(level);
+      tree_out.setCompressionLevel(level);
+      tessellations_out.setCompressionLevel(level);
+      geometry_out.setCompressionLevel(level);
+      extraGeometry_out.setCompressionLevel(level);
+    }
+    void enableStreamingCompression()
+    {
+      globals_out.enableStreamingCompression();
+      tree_out.enableStreamingCompression();
+      tessellations_out.enableStreamingCompression();
+      geometry_out.enableStreamingCompression();
+      extraGeometry_out.enableStreamingCompression();
+    }
     uint32_t getSize();
     void serializeFileStructureGlobals(PRCbitStream&);
     void serializeFileStructureTree(PRCbitStream&);
@@ -639,7 +662,8 @@ class oPRCFile
       fileStructures(new PRCFileStructure*[n]),
       unit(u),
       modelFile_data(NULL),modelFile_out(modelFile_data,0),
-      fout(NULL),output(os)
+      fout(NULL),output(os),
+      memory_limit(0),resident_point_bytes(0),spill_file(NULL),threads(1)
       {
         for(uint32_t i = 0; i < number_of_file_structures; ++i)
         {
@@ -668,7 +692,8 @@ class oPRCFile
       modelFile_data(NULL),modelFile_out(modelFile_data,0),
       fout(new std::ofstream(name.c_str(),
                              std::ios::out|std::ios::binary|std::ios::trunc)),
-      output(*fout)
+      output(*fout),
+      memory_limit(0),resident_point_bytes(0),spill_file(NULL),threads(1)
       {
         for(uint32_t i = 0; i < number_of_file_structures; ++i)
         {
@@ -697,6 +722,8 @@ class oPRCFile
       delete[] fileStructures;
       if(fout != NULL)
         delete fout;
+      if(spill_file != NULL)
+        fclose(spill_file);
       free(modelFile_data);
       for(PRCpictureMap::iterator it=pictureMap.begin(); it!=pictureMap.end(); ++it) delete it->first.data;
     }
@@ -712,6 +739,45 @@ class oPRCFile
     bool finish();
     uint32_t getSize();
 
+    // Once the points of pending point sets take more than bytes, they are
+    // moved to a temporary file until finish() writes them out.  0 keeps
+    // everything in memory.
+    void setMemoryLimit(uint64_t bytes) { memory_limit = bytes; }
+
+    // Spill the point sets kept in memory now, however little they take, e.g.
+    // once a group of them is complete.  Does nothing without a limit.
+    void spillPointSets();
+
+    // Deflate level of sections and pictures, 0 to PRCDeflateMaxLevel() or
+    // PRC_DEFAULT_COMPRESSION.  Set it before enabling streaming.
+    void setCompressionLevel(int level)
+    {
+      for(uint32_t i = 0; i < number_of_file_structures; ++i)
+        fileStructures[i]->setCompressionLevel(level);
+      modelFile_out.setCompressionLevel(level);
+    }
+
+    // Threads finish() may use to serialize and compress the sections.
+    void setThreads(unsigned n) { threads = n; }
+
+    // Deflate every section while it is serialized rather than afterwards,
+    // so only a small window of each stays uncompressed.  The file written
+    // is the same.
+    void enableStreamingCompression()
+    {
+      for(uint32_t i = 0; i < number_of_file_structures; ++i)
+        fileStructures[i]->enableStreamingCompression();
+      modelFile_out.enableStreamingCompression();
+    }
+
+    // Groups begun, and point sets placed in groups, so far.
+    uint32_t group_count = 0;
+    uint32_t point_set_count = 0;
+
+    // Time and sizes of grouping, serializing, compressing and writing,
+    // filled in by finish().
+    PRCStats stats;
+
     const uint32_t number_of_file_structures;
     PRCFileStructure **fileStructures;
     PRCHeader header;
@@ -742,6 +808,10 @@ class oPRCFile
     uint32_t addTransform(const double origin[3], const double x_axis[3], const double y_axis[3], double scale);
     void addPoint(const double P[3], const RGBAColour &c, double w=1.0);
     void addPoints(uint32_t n, const double ** P, const RGBAColour &c, double w=1.0);
+    // P holds n interleaved XYZ triplets
+    void addPoints(uint32_t n, const double * P, const RGBAColour &c, double w=1.0);
+    // takes ownership of P without copying the coordinates
+    void addPoints(std::vector<PRCVector3d>&& P, const RGBAColour &c, double w=1.0);
     void addLines(uint32_t nP, const double P[][3], uint32_t nI, const uint32_t PI[],
                       const RGBAColour& c, double w,
                       bool segment_color, uint32_t nC, const RGBAColour C[], uint32_t nCI, const uint32_t CI[]);
@@ -928,8 +998,14 @@ class oPRCFile
       }
   private:
     void serializeModelFileData(PRCbitStream&);
+    void trackPointSet(PRCPointSet *pointset);
     std::ofstream *fout;
     std::ostream &output;
+    uint64_t memory_limit;
+    uint64_t resident_point_bytes;
+    std::vector<PRCPointSet*> resident_pointsets;
+    FILE *spill_file;
+    unsigned threads;
 };
 
 #endif // __O_PRC_FILE_H
@@ -20,6 +20,7 @@
 
 #ifndef __WRITE_PRC_H
 #define __WRITE_PRC_H
+#include <cstdio>
 #include <string>
 #include <vector>
 #include <deque>
@@ -270,13 +271,13 @@ public:
   uint32_t unique_identifier;
 };
 
-extern std::string currentName;
+extern thread_local std::string currentName;
 void writeName(PRCbitStream&,const std::string&);
 void resetName();
 
-extern uint32_t current_layer_index;
-extern uint32_t current_index_of_line_style;
-extern uint16_t current_behaviour_bit_field;
+extern thread_local uint32_t current_layer_index;
+extern thread_local uint32_t current_index_of_line_style;
+extern thread_local uint16_t current_behaviour_bit_field;
 
 void writeGraphics(PRCbitStream&,uint32_t=m1,uint32_t=m1,uint16_t=1,bool=false);
 void resetGraphics();
@@ -678,10 +679,17 @@ class PRCPointSet : public PRCRepresentationItem
 {
 public:
   PRCPointSet(std::string n="") :
-    PRCRepresentationItem(PRC_TYPE_RI_PointSet,n) {}
+    PRCRepresentationItem(PRC_TYPE_RI_PointSet,n), spill_file(NULL), spill_count(0) {}
   void serializePointSet(PRCbitStream&);
   void serializeRepresentationItem(PRCbitStream &pbs) { serializePointSet(pbs); }
+  // Append the points to file as raw doubles and release them; they are
+  // read back, a block at a time, when the point set is serialized.  If
+  // they cannot be written the points are kept and false is returned.
+  bool spill(FILE *file);
   std::vector<PRCVector3d> point;
+  FILE *spill_file;
+  fpos_t spill_pos;
+  uint32_t spill_count;
 };
 
 class PRCWire : public PRCRepresentationItem
@@ -0,0 +1,161 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#include "ColorRamp.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace pdal
+{
+
+ColorRamp::ColorRamp(const std::vector<RGBAColour>& anchors,
+    std::size_t numClasses)
+{
+    if (numClasses == 0)
+        numClasses = 1;
+
+    if (anchors.size() < 2 || numClasses == anchors.size())
+    {
+        m_colours = anchors;
+        m_colours.resize(numClasses,
+            anchors.empty() ? RGBAColour(1.0, 1.0, 0.0) : anchors.back());
+        return;
+    }
+
+    m_colours.reserve(numClasses);
+    const double last = static_cast<double>(anchors.size() - 1);
+    for (std::size_t k = 0; k < numClasses; ++k)
+    {
+        double pos = (numClasses == 1) ? 0.0 :
+            last * k / static_cast<double>(numClasses - 1);
+        std::size_t lo = static_cast<std::size_t>(pos);
+        if (lo >= anchors.size() - 1)
+            lo = anchors.size() - 2;
+        const double f = pos - lo;
+        const RGBAColour& a = anchors[lo];
+        const RGBAColour& b = anchors[lo + 1];
+        m_colours.push_back(RGBAColour(a.R + f * (b.R - a.R),
+            a.G + f * (b.G - a.G), a.B + f * (b.B - a.B),
+            a.A + f * (b.A - a.A)));
+    }
+}
+
+
+// ColorBrewer sequential schemes, dark (low) to light (high).
+std::vector<RGBAColour> ColorRamp::oranges()
+{
+    return {
+        RGBAColour(127.0/255.0,  39.0/255.0,   4.0/255.0),
+        RGBAColour(166.0/255.0,  54.0/255.0,   3.0/255.0),
+        RGBAColour(217.0/255.0,  72.0/255.0,   1.0/255.0),
+        RGBAColour(241.0/255.0, 105.0/255.0,  19.0/255.0),
+        RGBAColour(253.0/255.0, 141.0/255.0,  60.0/255.0),
+        RGBAColour(253.0/255.0, 174.0/255.0, 107.0/255.0),
+        RGBAColour(253.0/255.0, 208.0/255.0, 162.0/255.0),
+        RGBAColour(254.0/255.0, 230.0/255.0, 206.0/255.0),
+        RGBAColour(255.0/255.0, 245.0/255.0, 235.0/255.0)
+    };
+}
+
+
+std::vector<RGBAColour> ColorRamp::blueGreen()
+{
+    return {
+        RGBAColour(0.0,  68.0/255.0,  27.0/255.0),
+        RGBAColour(0.0, 109.0/255.0,  44.0/255.0),
+        RGBAColour(35.0/255.0, 139.0/255.0,  69.0/255.0),
+        RGBAColour(65.0/255.0, 174.0/255.0, 118.0/255.0),
+        RGBAColour(102.0/255.0, 194.0/255.0, 164.0/255.0),
+        RGBAColour(153.0/255.0, 216.0/255.0, 201.0/255.0),
+        RGBAColour(204.0/255.0, 236.0/255.0, 230.0/255.0),
+        RGBAColour(229.0/255.0, 245.0/255.0, 249.0/255.0),
+        RGBAColour(247.0/255.0, 252.0/255.0, 253.0/255.0)
+    };
+}
+
+
+void ColorRamp::setLinear(double lo, double hi)
+{
+    const std::size_t n = size();
+    const double step = (hi - lo) / n;
+
+    m_thresholds.resize(n - 1);
+    for (std::size_t k = 0; k < n - 1; ++k)
+        m_thresholds[k] = lo + (k + 1) * step;
+}
+
+
+void ColorRamp::setSqrt(double lo, double hi)
+{
+    // A range reaching below zero is shifted to start at zero first, so
+    // every root is real; other ranges keep the roots of the values.
+    const double shift = std::min(lo, 0.0);
+    const std::size_t n = size();
+    const double root = std::sqrt(lo - shift);
+    const double step = (std::sqrt(hi - shift) - root) / n;
+
+    m_thresholds.resize(n - 1);
+    for (std::size_t k = 0; k < n - 1; ++k)
+    {
+        double t = root + (k + 1) * step;
+        m_thresholds[k] = t * t + shift;
+    }
+}
+
+
+void ColorRamp::setEqualized(const std::vector<uint64_t>& hist, double lo,
+    double hi)
+{
+    const std::size_t n = size();
+
+    m_thresholds.resize(n - 1);
+    for (std::size_t k = 0; k < n - 1; ++k)
+        m_thresholds[k] = quantile(hist, lo, hi, (k + 1) / double(n));
+}
+
+
+double ColorRamp::quantile(const std::vector<uint64_t>& hist, double lo,
+    double hi, double q)
+{
+    uint64_t total = 0;
+    for (uint64_t count : hist)
+        total += count;
+    if (total == 0 || hist.empty())
+        return lo;
+
+    const double width = (hi - lo) / hist.size();
+    const double target = q * total;
+    double below = 0;
+    for (std::size_t bin = 0; bin < hist.size(); ++bin)
+    {
+        if (hist[bin] && below + hist[bin] >= target)
+            return lo + width * (bin + (target - below) / hist[bin]);
+        below += hist[bin];
+    }
+    return hi;
+}
+
+
+void ColorRamp::translate(double d)
+{
+    for (double& t : m_thresholds)
+        t += d;
+}
+
+}  // namespace pdal
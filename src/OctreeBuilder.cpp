@@ -0,0 +1,54 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#include "OctreeBuilder.hpp"
+
+#include <cmath>
+
+namespace pdal
+{
+
+OctreeBuilder::OctreeBuilder(const double min[3], double spacing,
+    unsigned levels) : m_spacing(spacing), m_levels(levels ? levels : 1),
+    m_cells(m_levels - 1)
+{
+    m_min[0] = min[0];
+    m_min[1] = min[1];
+    m_min[2] = min[2];
+}
+
+
+uint8_t OctreeBuilder::insert(const double *xyz)
+{
+    const uint64_t mask = (1ULL << CellBits) - 1;
+
+    double edge = m_spacing;
+    for (unsigned level = 0; level + 1 < m_levels; ++level, edge /= 2)
+    {
+        uint64_t ix = static_cast<uint64_t>((xyz[0] - m_min[0]) / edge);
+        uint64_t iy = static_cast<uint64_t>((xyz[1] - m_min[1]) / edge);
+        uint64_t iz = static_cast<uint64_t>((xyz[2] - m_min[2]) / edge);
+        uint64_t key = (ix & mask) | ((iy & mask) << CellBits) |
+            ((iz & mask) << (2 * CellBits));
+        if (m_cells[level].insert(key).second)
+            return static_cast<uint8_t>(level);
+    }
+    return static_cast<uint8_t>(m_levels - 1);
+}
+
+} // namespace pdal
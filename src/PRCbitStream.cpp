@@ -19,71 +19,106 @@
 *************/
 
 #include <iostream>
-#include <zlib.h>
 #include <stdlib.h>
 #include <string.h>
 #include <cassert>
+#include <algorithm>
+#include <stdexcept>
 
 #include <prc/PRCbitStream.hpp>
+#include <prc/PRCdeflate.hpp>
 #include <prc/PRCdouble.hpp>
 
 using std::string;
 using std::cerr;
 using std::endl;
 
-void PRCbitStream::compress()
+PRCbitStream::~PRCbitStream()
 {
-  const int CHUNK= 1024; // is this reasonable?
-  compressedDataSize = 0;
-
-  z_stream strm;
-  strm.zalloc = Z_NULL;
-  strm.zfree = Z_NULL;
-  strm.opaque = Z_NULL;
-  if(deflateInit(&strm,Z_DEFAULT_COMPRESSION) != Z_OK)
-  {
-    cerr << "Compression initialization failed" << endl;
+  delete deflater;
+}
+
+void PRCbitStream::enableStreamingCompression()
+{
+  if(compressed || deflater != NULL || !PRCDeflateStream::available())
     return;
-  }
-  unsigned int sizeAvailable = deflateBound(&strm,getSize());
-  uint8_t *compressedData = (uint8_t*) malloc(sizeAvailable);
-  strm.avail_in = getSize();
-  strm.next_in = (unsigned char*)data;
-  strm.next_out = (unsigned char*)compressedData;
-  strm.avail_out = sizeAvailable;
-
-  int code;
-  unsigned int chunks = 0;
-  while((code = deflate(&strm,Z_FINISH)) == Z_OK)
+  deflater = new PRCDeflateStream(compressionLevel);
+  while(allocatedLength < DEFLATE_WINDOW)
+    getAChunk();
+}
+
+// Pass the complete bytes to the deflate stream and start the buffer over.
+void PRCbitStream::drain()
+{
+  deflater->write(data,byteIndex,false);
+  drainedBytes += byteIndex;
+  byteIndex = 0;
+  // the next drain comes before the window is full
+  if(drainedBytes+allocatedLength > MaxStreamBytes+1)
+    tooLarge();
+}
+
+void PRCbitStream::compress()
+{
+  sync();
+  size_t size;
+  uint8_t *compressedData;
+  if(deflater != NULL)
   {
-    ++chunks;
-    // strm.avail_out should be 0 if we got Z_OK
-    compressedDataSize = sizeAvailable - strm.avail_out;
-    compressedData = (uint8_t*) realloc(compressedData,CHUNK*chunks);
-    strm.next_out = (Bytef*)(compressedData + compressedDataSize);
-    strm.avail_out += CHUNK;
-    sizeAvailable += CHUNK;
+    deflater->write(data,byteIndex+bitCount/8+1,true);
+    compressedData = deflater->release(size);
+    delete deflater;
+    deflater = NULL;
   }
-  compressedDataSize = sizeAvailable-strm.avail_out;
-
-  if(code != Z_STREAM_END)
+  else
   {
-    cerr << "Compression error" << endl;
-    deflateEnd(&strm);
-    free(compressedData);
-    return;
+    compressedData = PRCDeflate(data,getSize(),compressionLevel,size,
+                                compressionThreads);
+    if(compressedData == NULL)
+    {
+      cerr << "Compression error" << endl;
+      return;
+    }
   }
-
+  compressedDataSize = size;
   compressed = true;
 
   free(data);
   data = compressedData;
+}
+
+void PRCbitStream::setSizeHint(size_t bytes)
+{
+  if(compressed || deflater != NULL)
+    return;
+  // a longer buffer could never be filled
+  bytes = std::min<uint64_t>(bytes,MaxStreamBytes-8)+9;
+  if(bytes <= allocatedLength)
+    return;
+  data = (uint8_t*)realloc((void*)data,bytes);
+  if(data == NULL)
+  {
+    cerr << "Memory allocation error." << endl;
+    exit(1);
+  }
+  allocatedLength = bytes;
+}
 
-  deflateEnd(&strm);
+void PRCbitStream::release()
+{
+  if(!compressed)
+    return;
+  free(data);
+  data = NULL;
 }
 
 void PRCbitStream::write(std::ostream &out) const
 {
+  if(compressed && data == NULL)
+  {
+    cerr << "Attempt to write stream after releasing it." << endl;
+    exit(1);
+  }
   if(compressed)
   {
     out.write((char*)data,compressedDataSize);
@@ -100,11 +135,13 @@ unsigned int PRCbitStream::getSize() const
   if(compressed)
     return compressedDataSize;
   else
-    return byteIndex+1;
+    return drainedBytes+byteIndex+bitCount/8+1;
 }
 
 uint8_t* PRCbitStream::getData()
 {
+  if(!compressed)
+    sync();
   return data;
 }
 
@@ -118,8 +155,8 @@ PRCbitStream& PRCbitStream::operator <<(uint32_t u)
 {
   while(u != 0)
   {
-    writeBit(1);
-    writeByte(u & 0xFF);
+    // a set continuation bit and the next byte
+    writeBits(0x100 | (u & 0xFF),9);
     u >>= 8;
   }
   writeBit(0);
@@ -138,9 +175,8 @@ PRCbitStream& PRCbitStream::operator <<(int32_t i)
   //while(!((current value is 0 and last byte was positive) OR (current value is -1 and last value was negative)))
   while(!(((i == 0)&&((lastByte & 0x80)==0))||((i == -1)&&((lastByte & 0x80) != 0))))
   {
-    writeBit(1);
     lastByte = i & 0xFF;
-    writeByte(lastByte);
+    writeBits(0x100 | lastByte,9);
     i >>= 8;
   }
   writeBit(0);
@@ -155,6 +191,8 @@ PRCbitStream& PRCbitStream::operator <<(double value)
     cerr << "Cannot write to a stream that has been compressed." << endl;
     return *this;
   }
+  // Past the check above, bits are appended directly.  Each value passed
+  // fits in its bit count.
   union ieee754_double *pid=(union ieee754_double *)&value;
   int
         i,
@@ -190,7 +228,7 @@ PRCbitStream& PRCbitStream::operator <<(double value)
   }
 
   for(i=1<<(pcofdoe->NumberOfBits-1);i>=1;i>>=1)
-    writeBit((pcofdoe->Bits&i)!=0);
+    appendBits((pcofdoe->Bits&i)!=0,1);
 
   if
   (
@@ -199,18 +237,18 @@ PRCbitStream& PRCbitStream::operator <<(double value)
   )
     return *this;
 
-  writeBit(pid->ieee.negative);
+  appendBits(pid->ieee.negative,1);
 
   if(pcofdoe->Type==VT_double)
     return *this;
 
   if(pid->ieee.mantissa0==0 && pid->ieee.mantissa1==0)
   {
-    writeBit(0);
+    appendBits(0,1);
     return *this;
   }
 
-  writeBit(1);
+  appendBits(1,1);
 
 #ifdef WORDS_BIGENDIAN
   pb=((PRCbyte *)&value)+1;
@@ -218,7 +256,7 @@ PRCbitStream& PRCbitStream::operator <<(double value)
   pb=((PRCbyte *)&value)+6;
 #endif
   //add_bits((*pb)&0x0f,4 STAT_V STAT_DOUBLE);
-  writeBits((*pb)&0x0F,4);
+  appendBits((*pb)&0x0F,4);
 
   NEXTBYTE(pb);
   pbStart=pb;
@@ -241,13 +279,13 @@ PRCbitStream& PRCbitStream::operator <<(double value)
   {
     if(pb!=pbStart && (pbResult=SEARCHBYTE(BEFOREBYTE(pb),*pb,DIFFPOINTERS(pb,pbStart)))!=NULL)
     {
-      writeBit(0);
-      writeBits(DIFFPOINTERS(pb,pbResult),3);
+      appendBits(0,1);
+      appendBits(DIFFPOINTERS(pb,pbResult),3);
     }
     else
     {
-      writeBit(1);
-      writeByte(*pb);
+      appendBits(1,1);
+      appendBits(*pb,8);
     }
   }
 
@@ -255,33 +293,118 @@ PRCbitStream& PRCbitStream::operator <<(double value)
   {
     if(fSaveAtEnd)
     {
-      writeBit(0);
-      writeBits(6,3);
-      writeByte(bSaveAtEnd);
+      appendBits(0,1);
+      appendBits(6,3);
+      appendBits(bSaveAtEnd,8);
     }
     else
     {
-      writeBit(0);
-      writeBits(0,3);
+      appendBits(0,1);
+      appendBits(0,3);
     }
   }
   else
   {
     if((pbResult=SEARCHBYTE(BEFOREBYTE(pb),*pb,DIFFPOINTERS(pb,pbStart)))!=NULL)
     {
-      writeBit(0);
-      writeBits(DIFFPOINTERS(pb,pbResult),3);
+      appendBits(0,1);
+      appendBits(DIFFPOINTERS(pb,pbResult),3);
     }
     else
     {
-      writeBit(1);
-      writeByte(*pb);
+      appendBits(1,1);
+      appendBits(*pb,8);
     }
   }
 
   return *this;
 }
 
+void PRCbitStream::writeDoubleRun(double value, BitRun &run,
+                                  PRCbitStream &scratch)
+{
+  if(run.valid && memcmp(&value,&run.value,sizeof(value)) == 0)
+  {
+    if(!run.encoded)
+    {
+      scratch << value;
+      scratch.takeBits(run);
+      run.encoded = true;
+    }
+    appendBits(run.word[0],run.bits[0]);
+    if(run.bits[1] != 0)
+      appendBits(run.word[1],run.bits[1]);
+    return;
+  }
+  *this << value;
+  run.value = value;
+  run.valid = true;
+  run.encoded = false;
+}
+
+void PRCbitStream::writeDoubles(const double *values, size_t n)
+{
+  if(compressed)
+  {
+    writeAfterCompress();
+    return;
+  }
+  uint8_t *scratch_data = NULL;
+  PRCbitStream scratch(scratch_data,0);
+  BitRun run;
+  for(size_t i = 0; i < n; ++i)
+    writeDoubleRun(values[i],run,scratch);
+  free(scratch_data);
+}
+
+void PRCbitStream::writeVector3ds(const double *xyz, size_t n)
+{
+  if(compressed)
+  {
+    writeAfterCompress();
+    return;
+  }
+  uint8_t *scratch_data = NULL;
+  PRCbitStream scratch(scratch_data,0);
+  // one run per axis, as a constant coordinate is common
+  BitRun run[3];
+  for(size_t i = 0; i < 3*n; i += 3)
+  {
+    writeDoubleRun(xyz[i],run[0],scratch);
+    writeDoubleRun(xyz[i+1],run[1],scratch);
+    writeDoubleRun(xyz[i+2],run[2],scratch);
+  }
+  free(scratch_data);
+}
+
+void PRCbitStream::writeUnsignedIntegers(const uint32_t *values, size_t n)
+{
+  if(compressed)
+  {
+    writeAfterCompress();
+    return;
+  }
+  uint32_t last = 0;
+  uint64_t code = 0;
+  unsigned int codeBits = 1;
+  for(size_t i = 0; i < n; ++i)
+  {
+    if(values[i] != last)
+    {
+      last = values[i];
+      code = 0;
+      codeBits = 1;
+      for(uint32_t u = last; u != 0; u >>= 8)
+      {
+        code = (code << 9) | 0x100 | (u & 0xFF);
+        codeBits += 9;
+      }
+      code <<= 1;
+    }
+    appendBits(code,codeBits);
+  }
+}
+
 PRCbitStream& PRCbitStream::operator <<(const char* s)
 {
   if (s == NULL)
@@ -309,91 +432,89 @@ PRCbitStream& PRCbitStream::operator <<(const string& s)
   return *this;
 }
 
-void PRCbitStream::writeBit(bool b)
+void PRCbitStream::flushWord()
 {
-  if(compressed)
+  uint8_t *p = data+byteIndex;
+  for(int i = 0; i < 8; ++i)
+    p[i] = static_cast<uint8_t>(bitBuffer >> (56-8*i));
+  byteIndex += 8;
+  if(byteIndex+9 > allocatedLength)
   {
-    cerr << "Cannot write to a stream that has been compressed." << endl;
-    return;
-  }
-
-  if(b)
-  {
-    data[byteIndex] |= (0x80 >> bitIndex);
+    if(deflater != NULL)
+      drain();
+    else
+      getAChunk();
   }
-  nextBit();
 }
 
-void PRCbitStream::writeBits(uint32_t u, uint8_t bits)
+// Store the pending bits after the complete bytes, zero padded to a whole
+// byte, plus a zero byte if they end on a byte boundary, as getSize()
+// counts one.  The bits stay pending, so writing can go on.
+void PRCbitStream::sync()
 {
-  if(bits > 32)
-    return;
-  else
-  {
-    for(uint32_t mask = (1 << (bits-1)); mask != 0; mask >>= 1)
-    {
-      writeBit((u&mask) != 0);
-    }
-  }
+  const uint64_t word = bitCount ? bitBuffer << (64-bitCount) : 0;
+  for(unsigned int i = 0; i <= bitCount/8; ++i)
+    data[byteIndex+i] = static_cast<uint8_t>(word >> (56-8*i));
 }
 
-void PRCbitStream::writeByte(uint8_t u)
+// Move everything written, at most 128 bits, into run and empty the stream.
+void PRCbitStream::takeBits(BitRun &run)
 {
-  if(compressed)
+  if(byteIndex == 0)
   {
-    cerr << "Cannot write to a stream that has been compressed." << endl;
-    return;
-  }
-
-  if(bitIndex == 0)
-  {
-    data[byteIndex] = u;
-    nextByte();
+    run.word[0] = bitBuffer;
+    run.bits[0] = bitCount;
+    run.word[1] = 0;
+    run.bits[1] = 0;
   }
   else
   {
-    data[byteIndex] |= (u >> bitIndex);
-    unsigned int obi = bitIndex;
-    nextByte();
-    data[byteIndex] |= (u << (8-obi));
-    bitIndex = obi; // bit index is not changed by writing 8 bits
+    run.word[0] = 0;
+    for(int i = 0; i < 8; ++i)
+      run.word[0] = (run.word[0] << 8) | data[i];
+    run.bits[0] = 64;
+    run.word[1] = bitBuffer;
+    run.bits[1] = bitCount;
   }
+  bitBuffer = 0;
+  bitCount = 0;
+  byteIndex = 0;
 }
 
-void PRCbitStream::nextBit()
+void PRCbitStream::writeAfterCompress() const
 {
-  ++bitIndex;
-  if(bitIndex == 8)
-  {
-    nextByte();
-  }
+  cerr << "Cannot write to a stream that has been compressed." << endl;
 }
 
-void PRCbitStream::nextByte()
+// A stream whose size getSize() cannot report is an error: the file
+// structure records the sizes in 32 bits.
+void PRCbitStream::tooLarge() const
 {
-  ++byteIndex;
-  if(byteIndex >= allocatedLength)
-    getAChunk();
-  data[byteIndex] = 0; // clear the garbage data
-  bitIndex = 0;
+  throw std::length_error("PRC stream larger than 4 GiB");
 }
 
+// Double the buffer, up to the length that holds MaxStreamBytes.  Beyond
+// that flushWord() would need room that getSize() cannot count.
 void PRCbitStream::getAChunk()
 {
-   if(allocatedLength==0)
-     data = (uint8_t*)realloc((void*)data,CHUNK_SIZE);
-   else
-     data = (uint8_t*)realloc((void*)data,2*allocatedLength);
+   const uint64_t max_length = MaxStreamBytes+1;
+   if(allocatedLength >= max_length)
+     tooLarge();
+   uint64_t length = CHUNK_SIZE;
+   if(allocatedLength != 0)
+     length = std::min<uint64_t>(2*uint64_t(allocatedLength),max_length);
+   if(length != size_t(length))
+   {
+     cerr << "Memory allocation error." << endl;
+     exit(1);
+   }
+   data = (uint8_t*)realloc((void*)data,length);
 
    if(data != NULL)
    {
      if(allocatedLength==0)
-     {
-       allocatedLength = CHUNK_SIZE;
        *data = 0; // clear first byte
-     }
-     else
-       allocatedLength *= 2;
+     allocatedLength = length;
    }
    else
    {
@@ -0,0 +1,341 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#include "PRCdeflate.hpp"
+#include "PRCjobQueue.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(PRC_WITH_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(PRC_WITH_ZLIB_NG)
+#include <zlib-ng.h>
+#define PRC_Z(name) zng_##name
+typedef zng_stream PRCzStream;
+#else
+#include <zlib.h>
+#define PRC_Z(name) name
+typedef z_stream PRCzStream;
+#endif
+
+using std::cerr;
+using std::endl;
+
+// Give back the unused end of a buffer allocated for the worst case.
+// Shrinking keeps the buffer in place, so the bytes are not copied.
+static uint8_t *shrink(uint8_t *buffer, size_t size)
+{
+  uint8_t *shrunk = (uint8_t*) realloc(buffer,size);
+  return shrunk != NULL ? shrunk : buffer;
+}
+
+#if defined(PRC_WITH_LIBDEFLATE)
+
+const char *PRCDeflateBackend()
+{
+  return "libdeflate " LIBDEFLATE_VERSION_STRING;
+}
+
+int PRCDeflateMaxLevel()
+{
+  return 12;
+}
+
+uint8_t *PRCDeflate(const uint8_t *in, size_t size, int level,
+                    size_t &compressed_size, unsigned threads)
+{
+  if(level == PRC_DEFAULT_COMPRESSION)
+    level = 6;
+  struct libdeflate_compressor *compressor = libdeflate_alloc_compressor(level);
+  if(compressor == NULL)
+    return NULL;
+  const size_t bound = libdeflate_zlib_compress_bound(compressor,size);
+  uint8_t *out = (uint8_t*) malloc(bound);
+  compressed_size = 0;
+  if(out != NULL)
+    compressed_size = libdeflate_zlib_compress(compressor,in,size,out,bound);
+  libdeflate_free_compressor(compressor);
+  if(compressed_size == 0)
+  {
+    free(out);
+    return NULL;
+  }
+  return shrink(out,compressed_size);
+}
+
+bool PRCDeflateStream::available()
+{
+  return false;
+}
+
+PRCDeflateStream::PRCDeflateStream(int level) :
+  stream(NULL), out(NULL), out_size(0), out_length(0)
+{
+  cerr << "Streaming compression is not available with libdeflate" << endl;
+  exit(1);
+}
+
+PRCDeflateStream::~PRCDeflateStream()
+{
+  free(out);
+}
+
+void PRCDeflateStream::write(const uint8_t *in, size_t size, bool finish)
+{
+}
+
+#else
+
+const char *PRCDeflateBackend()
+{
+#if defined(PRC_WITH_ZLIB_NG)
+  return "zlib-ng " ZLIBNG_VERSION;
+#else
+  return "zlib " ZLIB_VERSION;
+#endif
+}
+
+int PRCDeflateMaxLevel()
+{
+  return 9;
+}
+
+namespace {
+
+// Deflate distances reach back at most this far.
+const size_t dictionary_size = 32*1024;
+
+// One block of a stream compressed in parallel.
+struct DeflateBlock
+{
+  size_t begin, end;
+  uint8_t *out;
+  size_t out_size;
+  unsigned long check;
+};
+
+// Compress in[block.begin, block.end) as raw deflate data that carries on
+// from the input before it.  A block other than the last ends with a sync
+// flush, which leaves it on a byte boundary so the next block's data can
+// simply follow.
+bool deflateBlock(const uint8_t *in, size_t size, int level,
+                  DeflateBlock &block)
+{
+  const bool last = block.end == size;
+  const uint32_t length = block.end-block.begin;
+  block.check = PRC_Z(adler32)(1L,in+block.begin,length);
+
+  PRCzStream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  if(PRC_Z(deflateInit2)(&strm,level,Z_DEFLATED,-15,8,Z_DEFAULT_STRATEGY) != Z_OK)
+    return false;
+  if(block.begin > 0)
+  {
+    const size_t window = std::min(block.begin,dictionary_size);
+    PRC_Z(deflateSetDictionary)(&strm,in+block.begin-window,window);
+  }
+  // room for the empty stored block a sync flush appends
+  const size_t bound = PRC_Z(deflateBound)(&strm,length)+16;
+  block.out = (uint8_t*) malloc(bound);
+  if(block.out == NULL)
+  {
+    PRC_Z(deflateEnd)(&strm);
+    return false;
+  }
+  strm.next_in = const_cast<uint8_t*>(in+block.begin);
+  strm.avail_in = length;
+  strm.next_out = block.out;
+  strm.avail_out = bound;
+  const int code = PRC_Z(deflate)(&strm,last ? Z_FINISH : Z_SYNC_FLUSH);
+  block.out_size = bound-strm.avail_out;
+  PRC_Z(deflateEnd)(&strm);
+  return last ? code == Z_STREAM_END :
+    code == Z_OK && strm.avail_in == 0 && strm.avail_out > 0;
+}
+
+// The two byte zlib header deflateInit() writes for level.
+void zlibHeader(int level, uint8_t *header)
+{
+  if(level == PRC_DEFAULT_COMPRESSION)
+    level = 6;
+  const unsigned flags = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+  unsigned h = ((Z_DEFLATED+((15-8)<<4))<<8)|(flags<<6);
+  h += 31-h%31;
+  header[0] = h>>8;
+  header[1] = h&0xff;
+}
+
+uint8_t *deflateParallel(const uint8_t *in, size_t size, int level,
+                         size_t &compressed_size, unsigned threads)
+{
+  std::vector<DeflateBlock> blocks((size+PRC_DEFLATE_BLOCK-1)/PRC_DEFLATE_BLOCK);
+  std::vector<char> ok(blocks.size(),0);
+  {
+    PRCJobQueue jobs(std::min<size_t>(threads,blocks.size()));
+    for(size_t i = 0; i < blocks.size(); ++i)
+    {
+      blocks[i].begin = i*PRC_DEFLATE_BLOCK;
+      blocks[i].end = std::min(size,blocks[i].begin+PRC_DEFLATE_BLOCK);
+      blocks[i].out = NULL;
+      jobs.push([&, i]() { ok[i] = deflateBlock(in,size,level,blocks[i]); });
+    }
+    jobs.wait();
+  }
+
+  uint8_t *out = NULL;
+  if(std::find(ok.begin(),ok.end(),0) == ok.end())
+  {
+    size_t total = 2+4;
+    for(size_t i = 0; i < blocks.size(); ++i)
+      total += blocks[i].out_size;
+    out = (uint8_t*) malloc(total);
+  }
+  if(out != NULL)
+  {
+    zlibHeader(level,out);
+    compressed_size = 2;
+    unsigned long check = 1L;
+    for(size_t i = 0; i < blocks.size(); ++i)
+    {
+      memcpy(out+compressed_size,blocks[i].out,blocks[i].out_size);
+      compressed_size += blocks[i].out_size;
+      check = PRC_Z(adler32_combine)(check,blocks[i].check,
+                                     blocks[i].end-blocks[i].begin);
+    }
+    for(int i = 3; i >= 0; --i)
+      out[compressed_size++] = (check>>(8*i))&0xff;
+  }
+  for(size_t i = 0; i < blocks.size(); ++i)
+    free(blocks[i].out);
+  return out;
+}
+
+} // namespace
+
+uint8_t *PRCDeflate(const uint8_t *in, size_t size, int level,
+                    size_t &compressed_size, unsigned threads)
+{
+  if(threads > 1 && size > PRC_DEFLATE_BLOCK)
+    return deflateParallel(in,size,level,compressed_size,threads);
+
+  PRCzStream strm;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  if(PRC_Z(deflateInit)(&strm,level) != Z_OK)
+    return NULL;
+  // with deflateBound() bytes of room a single Z_FINISH completes the stream
+  const size_t bound = PRC_Z(deflateBound)(&strm,size);
+  uint8_t *out = (uint8_t*) malloc(bound);
+  if(out == NULL)
+  {
+    PRC_Z(deflateEnd)(&strm);
+    return NULL;
+  }
+  strm.next_in = const_cast<uint8_t*>(in);
+  strm.avail_in = size;
+  strm.next_out = out;
+  strm.avail_out = bound;
+  const int code = PRC_Z(deflate)(&strm,Z_FINISH);
+  compressed_size = bound-strm.avail_out;
+  PRC_Z(deflateEnd)(&strm);
+  if(code != Z_STREAM_END)
+  {
+    free(out);
+    return NULL;
+  }
+  return shrink(out,compressed_size);
+}
+
+bool PRCDeflateStream::available()
+{
+  return true;
+}
+
+PRCDeflateStream::PRCDeflateStream(int level) :
+  stream(NULL), out(NULL), out_size(0), out_length(0)
+{
+  PRCzStream *strm = new PRCzStream;
+  strm->zalloc = Z_NULL;
+  strm->zfree = Z_NULL;
+  strm->opaque = Z_NULL;
+  if(PRC_Z(deflateInit)(strm,level) != Z_OK)
+  {
+    cerr << "Compression initialization failed" << endl;
+    exit(1);
+  }
+  stream = strm;
+}
+
+PRCDeflateStream::~PRCDeflateStream()
+{
+  PRCzStream *strm = static_cast<PRCzStream*>(stream);
+  PRC_Z(deflateEnd)(strm);
+  delete strm;
+  free(out);
+}
+
+void PRCDeflateStream::write(const uint8_t *in, size_t size, bool finish)
+{
+  // deflate() leaves output pending whenever it fills the buffer, so keep
+  // growing it until all input is taken (or the stream is finished).
+  const size_t min_room = 1024;
+  PRCzStream *strm = static_cast<PRCzStream*>(stream);
+  strm->next_in = const_cast<uint8_t*>(in);
+  strm->avail_in = size;
+  int code;
+  do
+  {
+    if(out_length-out_size < min_room)
+    {
+      out_length = out_length ? 2*out_length : 256*1024;
+      out = (uint8_t*) realloc(out,out_length);
+      if(out == NULL)
+      {
+        cerr << "Memory allocation error." << endl;
+        exit(1);
+      }
+    }
+    strm->next_out = out+out_size;
+    strm->avail_out = out_length-out_size;
+    code = PRC_Z(deflate)(strm,finish ? Z_FINISH : Z_NO_FLUSH);
+    out_size = out_length-strm->avail_out;
+    if(code == Z_STREAM_ERROR)
+    {
+      cerr << "Compression error" << endl;
+      exit(1);
+    }
+  } while(finish ? code != Z_STREAM_END : strm->avail_out == 0);
+}
+
+#endif
+
+uint8_t *PRCDeflateStream::release(size_t &compressed_size)
+{
+  uint8_t *compressed = out_size ? shrink(out,out_size) : out;
+  compressed_size = out_size;
+  out = NULL;
+  out_size = out_length = 0;
+  return compressed;
+}
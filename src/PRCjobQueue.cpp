@@ -0,0 +1,95 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#include "PRCjobQueue.hpp"
+
+PRCJobQueue::PRCJobQueue(unsigned workers) :
+  running(0), stopping(false)
+{
+  for(unsigned i = 0; i < workers; ++i)
+    threads.push_back(std::thread(&PRCJobQueue::work, this));
+}
+
+PRCJobQueue::~PRCJobQueue()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  job_ready.notify_all();
+  for(size_t i = 0; i < threads.size(); ++i)
+    threads[i].join();
+}
+
+void PRCJobQueue::push(const std::function<void()> &job)
+{
+  if(threads.empty())
+  {
+    job();
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(job);
+  }
+  job_ready.notify_one();
+}
+
+void PRCJobQueue::wait()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while(!jobs.empty() || running > 0)
+    job_done.wait(lock);
+  if(error)
+  {
+    std::exception_ptr e = error;
+    error = NULL;
+    std::rethrow_exception(e);
+  }
+}
+
+void PRCJobQueue::work()
+{
+  std::unique_lock<std::mutex> lock(mutex);
+  while(true)
+  {
+    while(jobs.empty() && !stopping)
+      job_ready.wait(lock);
+    if(jobs.empty())
+      return;
+    std::function<void()> job = jobs.front();
+    jobs.pop_front();
+    ++running;
+    lock.unlock();
+    std::exception_ptr e;
+    try
+    {
+      job();
+    }
+    catch(...)
+    {
+      e = std::current_exception();
+    }
+    lock.lock();
+    if(e && !error)
+      error = e;
+    --running;
+    if(jobs.empty() && running == 0)
+      job_done.notify_all();
+  }
+}
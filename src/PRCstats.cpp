@@ -0,0 +1,102 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#include "PRCstats.hpp"
+
+#include <ctime>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+PRCPhaseStats& PRCStats::phase(const std::string &name)
+{
+  for(PhaseList::iterator it=phase_list.begin(); it!=phase_list.end(); ++it)
+    if(it->first == name)
+      return it->second;
+  phase_list.push_back(std::make_pair(name, PRCPhaseStats()));
+  return phase_list.back().second;
+}
+
+void PRCStats::add(const PRCStats &other)
+{
+  for(PhaseList::const_iterator it=other.phase_list.begin(); it!=other.phase_list.end(); ++it)
+  {
+    PRCPhaseStats &p = phase(it->first);
+    p.calls += it->second.calls;
+    p.wall_time += it->second.wall_time;
+    p.cpu_time += it->second.cpu_time;
+    p.bytes_in += it->second.bytes_in;
+    p.bytes_out += it->second.bytes_out;
+    if(it->second.peak_rss > p.peak_rss)
+      p.peak_rss = it->second.peak_rss;
+  }
+}
+
+double PRCStats::cpuTime()
+{
+#ifndef _WIN32
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+    usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+#else
+  return static_cast<double>(std::clock()) / CLOCKS_PER_SEC;
+#endif
+}
+
+uint64_t PRCStats::peakRss()
+{
+#ifndef _WIN32
+  struct rusage usage;
+  if(getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+#ifdef __APPLE__
+  return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+  return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+PRCPhaseTimer::PRCPhaseTimer(PRCStats *s, const std::string &n,
+                             uint64_t in) :
+  stats(s), name(n), bytes_in(in), bytes_out(0), cpu_start(0)
+{
+  if(stats == NULL)
+    return;
+  wall_start = std::chrono::steady_clock::now();
+  cpu_start = PRCStats::cpuTime();
+}
+
+PRCPhaseTimer::~PRCPhaseTimer()
+{
+  if(stats == NULL)
+    return;
+  PRCPhaseStats &phase = stats->phase(name);
+  phase.calls++;
+  phase.wall_time += std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - wall_start).count();
+  phase.cpu_time += PRCStats::cpuTime() - cpu_start;
+  phase.bytes_in += bytes_in;
+  phase.bytes_out += bytes_out;
+  phase.peak_rss = PRCStats::peakRss();
+}
@@ -21,9 +21,15 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdio>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <map>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <hpdf.h>
@@ -31,12 +37,15 @@
 #include <hpdf_annotation.h>
 
 #include <pdal/Dimension.hpp>
+#include <pdal/PointRef.hpp>
 #include <pdal/PointView.hpp>
 #include <pdal/StageFactory.hpp>
 #include <pdal/util/Utils.hpp>
 
 #include "oPRCFile.hpp"
 #include "ColorQuantizer.hpp"
+#include "ColorRamp.hpp"
+#include "OctreeBuilder.hpp"
 
 namespace pdal
 {
@@ -48,6 +57,41 @@ static PluginInfo const s_info = PluginInfo(
 
 CREATE_SHARED_PLUGIN(1, 0, PrcWriter, Writer, s_info)
 
+namespace
+{
+
+// Call fn(slice, begin, end) for numSlices contiguous slices of [0, n), each
+// on its own thread.  A single slice runs on the calling thread.
+template<typename Fn>
+void forEachSlice(point_count_t n, unsigned numSlices, Fn fn)
+{
+    if (numSlices <= 1)
+    {
+        fn(0, 0, n);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(numSlices);
+    for (unsigned slice = 0; slice < numSlices; ++slice)
+        workers.emplace_back(fn, slice, n * slice / numSlices,
+            n * (slice + 1) / numSlices);
+    for (std::thread& worker : workers)
+        worker.join();
+}
+
+// Options shared by the "points" group and the octree level groups.
+PRCoptions groupOptions()
+{
+    PRCoptions grpopt;
+    grpopt.no_break = true;
+    grpopt.do_break = false;
+    grpopt.tess = true;
+    return grpopt;
+}
+
+} // unnamed namespace
+
 std::string PrcWriter::getName() const
 {
     return s_info.name;
@@ -62,8 +106,60 @@ void PrcWriter::addArgs(ProgramArgs& args)
     args.add("output_format", "PRC or PDF", m_outputFormat, OutputFormat::Pdf);
     args.add("color_scheme", "Solid, oranges, or blue-green",
         m_colorScheme, ColorScheme::Solid);
-    args.add("contrast_stretch", "Linear or sqrt", m_contrastStretch,
-        ContrastStretch::Linear);
+    args.add("contrast_stretch", "Linear, sqrt, equalize or percentile",
+        m_contrastStretch, ContrastStretch::Linear);
+    args.add("clip_percent", "Percentage of values clipped at each end by "
+        "the percentile stretch", m_clipPercent, 2.0);
+    args.add("color_dimension", "Dimension the oranges and blue-green ramps "
+        "are applied to", m_colorDimName, std::string("Z"));
+    args.add("color_classes", "Number of classes in the oranges and "
+        "blue-green ramps", m_colorClasses, (uint16_t)9);
+    args.add("point_set_memory_limit", "Memory in MiB that finished point "
+        "sets may use before they are spilled to a temporary file; the points "
+        "being read and binned are not counted.  Any limit implies "
+        "stream_compression (0 for no limit)", m_pointSetMemoryLimit,
+        (uint64_t)0);
+    args.add("stream_compression", "Deflate the PRC sections while they are "
+        "serialized, so that none is held uncompressed in full",
+        m_streamCompression, false);
+    args.add("compression_level", "Deflate level of the PRC sections, from 0 "
+        "(fastest) to 9, or 12 with libdeflate; -1 for the default",
+        m_compressionLevel, PRC_DEFAULT_COMPRESSION);
+    args.add("threads", "Number of threads used to bin points and to "
+        "compress the PRC sections (0 for one per core)", m_threads, 1u);
+    args.add("merge_views", "Bin the points of all views together in one "
+        "coordinate frame", m_mergeViews, false);
+    args.add("header_center", "Centre on the bounds in the reader's header "
+        "instead of the bounds of the data, which lets a stream be binned as "
+        "it is read", m_headerCenter, false);
+    args.add("voxel_size", "Edge length of the voxel grid used to decimate "
+        "points (0 to keep every point)", m_voxelSize, 0.0);
+    args.add("voxel_method", "First or centroid", m_voxelMethod,
+        VoxelMethod::First);
+    args.add("octree_levels", "Number of octree levels of detail, each "
+        "written as its own group (0 or 1 for a single level)",
+        m_octreeLevels, 0u);
+    args.add("octree_spacing", "Cell edge of the coarsest octree level (0 "
+        "for 1/128 of the extent)", m_octreeSpacing, 0.0);
+    args.add("max_points", "Maximum number of points written, chosen by "
+        "random sampling (0 for no limit)", m_maxPoints, (point_count_t)0);
+    args.add("tile_size", "Edge length of the XY tiles, each written as its "
+        "own group and, with point_set_memory_limit, spilled once written "
+        "(0 for no tiling)", m_tileSize, 0.0);
+    args.add("tile_count", "Number of XY tiles along each axis, as an "
+        "alternative to tile_size", m_tileCount, 0u);
+    args.add("color_bits", "Bits per RGB component in the input: 8, 16, or 0 "
+        "to take 16 once any component is above 255", m_colorBits, 0u);
+    args.add("color_palette", "Palette for RGB input: median_cut, rgb332 or "
+        "rgb444", m_colorPalette, ColorPalette::MedianCut);
+    args.add("snap", "Snap centred coordinates to the largest power-of-two "
+        "step not above the source scale", m_snap, false);
+    args.add("snap_tolerance", "Snap centred coordinates to the largest "
+        "power-of-two step not above this value instead", m_snapTolerance,
+        0.0);
+    args.add("seed", "Seed for the random sampling", m_seed, (uint64_t)0);
+    args.add("stream_batch", "Number of points binned at a time when a stream "
+        "is binned as it is read", m_streamBatch, StreamBatch);
     args.add("fov", "Field of View", m_fov, 30.0f);
     args.add("coox", "Camera coox", m_coox);
     args.add("cooy", "Camera cooy", m_cooy);
@@ -78,30 +174,177 @@ void PrcWriter::addArgs(ProgramArgs& args)
 
 void PrcWriter::initialize()
 {
+    if (m_colorClasses == 0)
+        throw pdal_error("Option 'color_classes' must be positive.");
+    if (m_voxelSize < 0)
+        throw pdal_error("Option 'voxel_size' can't be negative.");
+    if (m_octreeLevels > MaxOctreeLevels)
+        throw pdal_error("Option 'octree_levels' can't exceed " +
+            std::to_string(MaxOctreeLevels) + ".");
+    if (m_octreeSpacing < 0)
+        throw pdal_error("Option 'octree_spacing' can't be negative.");
+    if (m_tileSize < 0)
+        throw pdal_error("Option 'tile_size' can't be negative.");
+    if (static_cast<double>(m_tileCount) * m_tileCount > MaxTiles)
+        throw pdal_error("Option 'tile_count' gives more than " +
+            std::to_string(MaxTiles) + " tiles.");
+    if (m_tileSize > 0 && m_tileCount > 0)
+        throw pdal_error("Options 'tile_size' and 'tile_count' can't both "
+            "be set.");
+    if (m_clipPercent < 0 || m_clipPercent >= 50)
+        throw pdal_error("Option 'clip_percent' must be at least 0 and less "
+            "than 50.");
+    if (m_snapTolerance < 0)
+        throw pdal_error("Option 'snap_tolerance' can't be negative.");
+    if (m_colorBits != 0 && m_colorBits != 8 && m_colorBits != 16)
+        throw pdal_error("Option 'color_bits' must be 0, 8 or 16.");
+    if (m_streamBatch == 0)
+        throw pdal_error("Option 'stream_batch' must be positive.");
+    if (m_compressionLevel < PRC_DEFAULT_COMPRESSION ||
+            m_compressionLevel > PRCDeflateMaxLevel())
+        throw pdal_error("Option 'compression_level' must be between -1 and " +
+            std::to_string(PRCDeflateMaxLevel()) + ".");
+    if (m_threads == 0)
+        m_threads = std::max(1u, std::thread::hardware_concurrency());
     m_prcFile = std::unique_ptr<oPRCFile>(new oPRCFile(filename(),1000));
+    m_prcFile->setMemoryLimit(m_pointSetMemoryLimit << 20);
+    m_prcFile->setCompressionLevel(m_compressionLevel);
+    m_prcFile->setThreads(m_threads);
+    if (m_streamCompression || m_pointSetMemoryLimit)
+        m_prcFile->enableStreamingCompression();
 }
 
 
 void PrcWriter::ready(PointTableRef table)
 {
-    PRCoptions grpopt;
-    grpopt.no_break = true;
-    grpopt.do_break = false;
-    grpopt.tess = true;
+    PointLayoutPtr layout(table.layout());
+    // The ramps colour points by a dimension, so RGB is only read, and only
+    // keys voxels, under the solid scheme.
+    m_haveColor = m_colorScheme == ColorScheme::Solid &&
+        layout->hasDim(Dimension::Id::Red) &&
+        layout->hasDim(Dimension::Id::Green) &&
+        layout->hasDim(Dimension::Id::Blue);
+    m_bounds.clear();
+    m_pointCount = 0;
+
+    m_rng.seed(m_seed);
+    m_sampled = 0;
+
+    m_haveCenter = false;
+    if (m_headerCenter)
+        findHeaderCenter(table.metadata());
+
+    m_snapStep[0] = m_snapStep[1] = m_snapStep[2] = 0;
+    if (m_snapTolerance > 0)
+        m_snapStep[0] = m_snapStep[1] = m_snapStep[2] =
+            snapStep(m_snapTolerance);
+    else if (m_snap)
+        findSourceScale(table.metadata());
+
+    m_colorShift = (m_colorBits == 16) ? 8 : 0;
+    m_detectColorBits = (m_colorBits == 0);
+
+    m_packedDims.clear();
+    m_packedDims.push_back(DimType(Dimension::Id::X, Dimension::Type::Double));
+    m_packedDims.push_back(DimType(Dimension::Id::Y, Dimension::Type::Double));
+    m_packedDims.push_back(DimType(Dimension::Id::Z, Dimension::Type::Double));
+    m_packedSize = 3 * sizeof(double);
+    if (m_haveColor)
+    {
+        m_packedDims.push_back(
+            DimType(Dimension::Id::Red, Dimension::Type::Unsigned16));
+        m_packedDims.push_back(
+            DimType(Dimension::Id::Green, Dimension::Type::Unsigned16));
+        m_packedDims.push_back(
+            DimType(Dimension::Id::Blue, Dimension::Type::Unsigned16));
+        m_packedSize += 3 * sizeof(uint16_t);
+    }
 
+    // With a colour ramp, any dimension but Z is read alongside, converted
+    // to double.  Solid and RGB colouring never look at it.
+    m_colorDim = layout->findDim(m_colorDimName);
+    if (m_colorDim == Dimension::Id::Unknown)
+        throw pdal_error("Dimension '" + m_colorDimName + "' given for "
+            "option 'color_dimension' not found.");
+    if (m_colorScheme == ColorScheme::Solid && m_colorDim != Dimension::Id::Z)
+        log()->get(LogLevel::Warning) << "Option 'color_dimension' is "
+            "ignored by the solid color scheme; use oranges or blue-green "
+            "to color by '" << m_colorDimName << "'." << std::endl;
+    m_valueIsInteger = Dimension::base(layout->dimType(m_colorDim)) !=
+        Dimension::BaseType::Floating;
+    m_haveValues = m_colorDim != Dimension::Id::Z &&
+        (m_colorScheme == ColorScheme::Oranges ||
+        m_colorScheme == ColorScheme::BlueGreen);
+    m_valueMin = std::numeric_limits<double>::max();
+    m_valueMax = std::numeric_limits<double>::lowest();
+    m_valueOffset = m_packedSize;
+    if (m_haveValues)
+    {
+        m_packedDims.push_back(DimType(m_colorDim, Dimension::Type::Double));
+        m_packedSize += sizeof(double);
+    }
+    m_packed.resize(m_packedSize);
+
+    // Colours depend on the input; tiles from tile_size on the bounds,
+    // checked when the points are binned.
+    checkBins(m_tileCount > 1 ? m_tileCount * m_tileCount : 1, maxColors());
+
+    m_streamed = 0;
+    m_streamStart = std::chrono::steady_clock::now();
+    m_streamCpu = PRCStats::cpuTime();
+
+    // Centring on the data, ramps, median cut, octrees, tiles, budgets and
+    // voxels all need every point before any can be binned.  Without them a
+    // stream is binned in batches, each adding its own point sets.
+    m_streamBatches = m_haveCenter && m_colorScheme == ColorScheme::Solid &&
+        (!m_haveColor || m_colorPalette != ColorPalette::MedianCut) &&
+        m_octreeLevels <= 1 && m_tileSize == 0 && m_tileCount <= 1 &&
+        m_maxPoints == 0 && m_voxelSize == 0;
+
+    PRCoptions grpopt = groupOptions();
     m_prcFile->begingroup("points",&grpopt);
 }
 
 
 void PrcWriter::done(PointTableRef table)
 {
+    if (m_streamed)
+    {
+        PRCPhaseStats& read = m_prcFile->stats.phase("read_points");
+        read.calls++;
+        read.wall_time += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - m_streamStart).count();
+        read.cpu_time += PRCStats::cpuTime() - m_streamCpu;
+        read.bytes_in += m_streamed * m_packedSize;
+        read.peak_rss = PRCStats::peakRss();
+    }
+
+    // Unless a stream is binned in batches, nothing is binned until all
+    // points have arrived in streaming mode or when views are merged.
+    flushPoints();
+
     log()->get(LogLevel::Debug4) << "Finalizing PRC." << std::endl;
     m_prcFile->endgroup();
-    m_prcFile->finish();
+    try
+    {
+        m_prcFile->finish();
+    }
+    catch (const std::length_error& err)
+    {
+        throw pdal_error("Unable to write '" + filename() + "': " +
+            err.what());
+    }
+
+    // What was written, so that pipelines can be checked against it.
+    m_metadata.add("group_count", m_prcFile->group_count);
+    m_metadata.add("point_set_count", m_prcFile->point_set_count);
+    m_metadata.add("point_count", m_pointCount);
 
     if (m_outputFormat == OutputFormat::Pdf)
     {
         log()->get(LogLevel::Debug4) << "Writing PDF." << std::endl;
+        PRCPhaseTimer timer(&m_prcFile->stats, "pdf",
+            m_prcFile->header.file_size);
 
         const float width = 256.0f;
         const float height = 256.0f;
@@ -167,405 +410,994 @@ void PrcWriter::done(PointTableRef table)
         HPDF_SaveToFile(pdf, m_pdfFilename.c_str());
         HPDF_Free(pdf);
     }
+
+    publishStats();
+}
+
+
+// Add the time and sizes of every phase to the stage metadata, and log them
+// as a table.
+void PrcWriter::publishStats()
+{
+    const PRCStats::PhaseList& phases = m_prcFile->stats.phases();
+
+    std::ostringstream oss;
+    char line[200];
+    snprintf(line, sizeof(line), "%-24s %6s %9s %9s %11s %11s %11s", "phase",
+        "calls", "wall s", "cpu s", "in MiB", "out MiB", "peak MiB");
+    oss << line << std::endl;
+    for (const auto& phase : phases)
+    {
+        const PRCPhaseStats& ps = phase.second;
+        MetadataNode node = m_metadata.add(phase.first);
+        node.add("calls", static_cast<uint64_t>(ps.calls));
+        node.add("wall_time", ps.wall_time, "Wall time in seconds");
+        node.add("cpu_time", ps.cpu_time, "CPU time in seconds");
+        node.add("bytes_in", ps.bytes_in);
+        node.add("bytes_out", ps.bytes_out);
+        node.add("peak_rss", ps.peak_rss, "Peak resident memory in bytes");
+
+        snprintf(line, sizeof(line),
+            "%-24s %6u %9.3f %9.3f %11.2f %11.2f %11.2f",
+            phase.first.c_str(), ps.calls, ps.wall_time, ps.cpu_time,
+            ps.bytes_in / 1048576.0, ps.bytes_out / 1048576.0,
+            ps.peak_rss / 1048576.0);
+        oss << line << std::endl;
+    }
+    log()->get(LogLevel::Debug) << oss.str();
 }
 
 void PrcWriter::write(const PointViewPtr view)
 {
-    uint32_t numPoints = 0;
+    // Points are read a block at a time with one packed, typed read per
+    // point instead of a getFieldAs() call per dimension.
+    const point_count_t BlockSize = 4096;
+
+    // Unless views are merged, each view is binned and centred on its own.
+    // A point budget covers the whole output, so it implies merging.
+    const bool perView = !m_mergeViews && m_maxPoints == 0;
+    if (perView)
+        m_bounds.clear();
+    // Decimated output is usually far smaller than the view.
+    if (perView && m_voxelSize == 0)
+    {
+        m_xyz.reserve(3 * view->size());
+        if (m_haveColor)
+            m_colors.reserve(view->size());
+    }
+    m_packed.resize(BlockSize * m_packedSize);
 
-    view->calculateBounds(m_bounds);
-    double zmin = m_bounds.minz;
-    double zmax = m_bounds.maxz;
-    double cz2 = (zmax-zmin)/2+zmin;
-    HPDF_REAL cooz = static_cast<HPDF_REAL>(cz2);
+    {
+        // Bounds and voxels are updated as the points are read, so they are
+        // counted here.
+        PRCPhaseTimer timer(&m_prcFile->stats, "read_points",
+            view->size() * m_packedSize);
+        for (PointId begin = 0; begin < view->size(); begin += BlockSize)
+        {
+            const point_count_t count =
+                std::min<point_count_t>(BlockSize, view->size() - begin);
 
-    char msg[1000];
-    sprintf(msg, "cz: %f, min: %f, max: %f, cooz: %f", cz2, zmin, zmax, cooz);
-    log()->get(LogLevel::Debug2) << msg << std::endl ;
+            char *pos = m_packed.data();
+            for (PointId idx = begin; idx < begin + count; ++idx)
+            {
+                view->getPackedPoint(m_packedDims, idx, pos);
+                pos += m_packedSize;
+            }
+            appendPacked(count);
+        }
+    }
+    if (perView)
+        flushPoints();
+}
 
-    double cx = (m_bounds.maxx-m_bounds.minx)/2+m_bounds.minx;
-    double cy = (m_bounds.maxy-m_bounds.miny)/2+m_bounds.miny;
-    double cz = (m_bounds.maxz-m_bounds.minz)/2+m_bounds.minz;
 
-    if ((m_colorScheme == ColorScheme::Oranges) ||
-            (m_colorScheme == ColorScheme::BlueGreen))
+bool PrcWriter::processOne(PointRef& point)
+{
+    point.getPackedData(m_packedDims, m_packed.data());
+    appendPacked(1);
+    m_streamed++;
+    if (m_streamBatches && m_xyz.size() >= 3 * m_streamBatch)
+        flushPoints();
+    return true;
+}
+
+
+// Move count packed points from m_packed into the point buffer.
+void PrcWriter::appendPacked(point_count_t count)
+{
+    if (m_voxelSize > 0)
     {
-        double **p0, **p1, **p2, **p3, **p4, **p5, **p6, **p7, **p8;
-        p0 = (double**) malloc(view->size()*sizeof(double*));
-        p1 = (double**) malloc(view->size()*sizeof(double*));
-        p2 = (double**) malloc(view->size()*sizeof(double*));
-        p3 = (double**) malloc(view->size()*sizeof(double*));
-        p4 = (double**) malloc(view->size()*sizeof(double*));
-        p5 = (double**) malloc(view->size()*sizeof(double*));
-        p6 = (double**) malloc(view->size()*sizeof(double*));
-        p7 = (double**) malloc(view->size()*sizeof(double*));
-        p8 = (double**) malloc(view->size()*sizeof(double*));
-
-        for (point_count_t i = 0; i < view->size(); ++i)
+        appendVoxels(count);
+        return;
+    }
+
+    const point_count_t first = m_xyz.size() / 3;
+    m_xyz.resize(3 * (first + count));
+    double *xyz = m_xyz.data() + 3 * first;
+
+    const char *pos = m_packed.data();
+    for (point_count_t i = 0; i < count; ++i, pos += m_packedSize)
+        std::memcpy(xyz + 3 * i, pos, 3 * sizeof(double));
+
+    for (point_count_t i = 0; i < count; ++i)
+        m_bounds.grow(xyz[3*i+0], xyz[3*i+1], xyz[3*i+2]);
+
+    // With a known centre the points are centred here, while still in cache.
+    if (m_haveCenter)
+        for (point_count_t i = 0; i < count; ++i)
         {
-            p0[i] = (double*) malloc(3*sizeof(double));
-            p1[i] = (double*) malloc(3*sizeof(double));
-            p2[i] = (double*) malloc(3*sizeof(double));
-            p3[i] = (double*) malloc(3*sizeof(double));
-            p4[i] = (double*) malloc(3*sizeof(double));
-            p5[i] = (double*) malloc(3*sizeof(double));
-            p6[i] = (double*) malloc(3*sizeof(double));
-            p7[i] = (double*) malloc(3*sizeof(double));
-            p8[i] = (double*) malloc(3*sizeof(double));
+            xyz[3*i+0] -= m_cx;
+            xyz[3*i+1] -= m_cy;
+            xyz[3*i+2] -= m_cz;
         }
 
-        double xd(0.0);
-        double yd(0.0);
-        double zd(0.0);
+    if (m_haveColor)
+    {
+        pos = m_packed.data() + 3 * sizeof(double);
+        for (point_count_t i = 0; i < count; ++i, pos += m_packedSize)
+        {
+            uint16_t rgb[3];
+            std::memcpy(rgb, pos, sizeof(rgb));
+            m_colors.push_back(colorKey(rgb));
+        }
+    }
+
+    if (m_haveValues)
+    {
+        pos = m_packed.data() + m_valueOffset;
+        for (point_count_t i = 0; i < count; ++i, pos += m_packedSize)
+        {
+            double value;
+            std::memcpy(&value, pos, sizeof(value));
+            m_valueMin = std::min(m_valueMin, value);
+            m_valueMax = std::max(m_valueMax, value);
+            m_values.push_back(value);
+        }
+    }
 
-        RGBAColour c0, c1, c2, c3, c4, c5, c6, c7, c8;
+    if (m_maxPoints)
+        samplePoints(first, m_sampled);
+}
 
-        if (m_colorScheme == ColorScheme::BlueGreen)
+
+// Move count packed points from m_packed into the point buffer, keeping one
+// point per occupied voxel (and per colour, when points are coloured from
+// their RGB).  The
+// kept point is either the first to land in the voxel or the running mean of
+// all of them.
+void PrcWriter::appendVoxels(point_count_t count)
+{
+    const char *pos = m_packed.data();
+    for (point_count_t i = 0; i < count; ++i, pos += m_packedSize)
+    {
+        double p[3];
+        std::memcpy(p, pos, sizeof(p));
+        m_bounds.grow(p[0], p[1], p[2]);
+        if (m_haveCenter)
         {
-            c8.Set(247.0/255.0, 252.0/255.0, 253.0/255.0);
-            c7.Set(229.0/255.0, 245.0/255.0, 249.0/255.0);
-            c6.Set(204.0/255.0, 236.0/255.0, 230.0/255.0);
-            c5.Set(153.0/255.0, 216.0/255.0, 201.0/255.0);
-            c4.Set(102.0/255.0, 194.0/255.0, 164.0/255.0);
-            c3.Set(65.0/255.0, 174.0/255.0, 118.0/255.0);
-            c2.Set(35.0/255.0, 139.0/255.0,  69.0/255.0);
-            c1.Set(0.0, 109.0/255.0,  44.0/255.0);
-            c0.Set(0.0,  68.0/255.0,  27.0/255.0);
+            p[0] -= m_cx;
+            p[1] -= m_cy;
+            p[2] -= m_cz;
         }
-        else if (m_colorScheme == ColorScheme::Oranges)
+
+        VoxelKey key;
+        key.x = static_cast<int64_t>(std::floor(p[0] / m_voxelSize));
+        key.y = static_cast<int64_t>(std::floor(p[1] / m_voxelSize));
+        key.z = static_cast<int64_t>(std::floor(p[2] / m_voxelSize));
+        key.color = 0;
+        if (m_haveColor)
         {
-            c8.Set(255.0/255.0, 245.0/255.0, 235.0/255.0);
-            c7.Set(254.0/255.0, 230.0/255.0, 206.0/255.0);
-            c6.Set(253.0/255.0, 208.0/255.0, 162.0/255.0);
-            c5.Set(253.0/255.0, 174.0/255.0, 107.0/255.0);
-            c4.Set(253.0/255.0, 141.0/255.0,  60.0/255.0);
-            c3.Set(241.0/255.0, 105.0/255.0,  19.0/255.0);
-            c2.Set(217.0/255.0,  72.0/255.0,   1.0/255.0);
-            c1.Set(166.0/255.0,  54.0/255.0,   3.0/255.0);
-            c0.Set(127.0/255.0,  39.0/255.0,   4.0/255.0);
+            uint16_t rgb[3];
+            std::memcpy(rgb, pos + sizeof(p), sizeof(rgb));
+            key.color = colorKey(rgb);
         }
 
-        double range(0.0), step(0.0), t0(0.0), t1(0.0), t2(0.0), t3(0.0),
-               t4(0.0), t5(0.0), t6(0.0), t7(0.0);
+        double value = 0;
+        if (m_haveValues)
+        {
+            std::memcpy(&value, pos + m_valueOffset, sizeof(value));
+            m_valueMin = std::min(m_valueMin, value);
+            m_valueMax = std::max(m_valueMax, value);
+        }
 
-        if (m_contrastStretch == ContrastStretch::Sqrt)
+        const point_count_t next = m_xyz.size() / 3;
+        auto inserted = m_voxels.insert(std::make_pair(key, next));
+        if (inserted.second)
         {
-            range = std::sqrt(m_bounds.maxz) - std::sqrt(m_bounds.minz);
-            step = range / 9;
-            t0 = std::sqrt(m_bounds.minz) + 1*step;
-            t1 = std::sqrt(m_bounds.minz) + 2*step;
-            t2 = std::sqrt(m_bounds.minz) + 3*step;
-            t3 = std::sqrt(m_bounds.minz) + 4*step;
-            t4 = std::sqrt(m_bounds.minz) + 5*step;
-            t5 = std::sqrt(m_bounds.minz) + 6*step;
-            t6 = std::sqrt(m_bounds.minz) + 7*step;
-            t7 = std::sqrt(m_bounds.minz) + 8*step;
-
-            t0 = t0*t0;
-            t1 = t1*t1;
-            t2 = t2*t2;
-            t3 = t3*t3;
-            t4 = t4*t4;
-            t5 = t5*t5;
-            t6 = t6*t6;
-            t7 = t7*t7;
+            m_xyz.insert(m_xyz.end(), p, p + 3);
+            if (m_haveColor)
+                m_colors.push_back(key.color);
+            if (m_haveValues)
+                m_values.push_back(value);
+            if (m_voxelMethod == VoxelMethod::Centroid)
+                m_voxelCounts.push_back(1);
         }
-        else if (0)
+        else if (m_voxelMethod == VoxelMethod::Centroid)
         {
-            range = m_bounds.minz - m_bounds.minz;
-            double twoper = range * 0.02;
-            log()->get(LogLevel::Debug2) << twoper << std::endl;
-            step = (range - 2 * twoper) / 7;
-            t0 = m_bounds.minz + twoper;
-            t1 = m_bounds.minz + twoper + 1 * step;
-            t2 = m_bounds.minz + twoper + 2 * step;
-            t3 = m_bounds.minz + twoper + 3 * step;
-            t4 = m_bounds.minz + twoper + 4 * step;
-            t5 = m_bounds.minz + twoper + 5 * step;
-            t6 = m_bounds.minz + twoper + 6 * step;
-            t7 = m_bounds.minz + twoper + 7 * step;
+            const point_count_t idx = inserted.first->second;
+            const double n = ++m_voxelCounts[idx];
+            double *mean = m_xyz.data() + 3 * idx;
+            mean[0] += (p[0] - mean[0]) / n;
+            mean[1] += (p[1] - mean[1]) / n;
+            mean[2] += (p[2] - mean[2]) / n;
+            if (m_haveValues)
+                m_values[idx] += (value - m_values[idx]) / n;
         }
-        else if (m_contrastStretch == ContrastStretch::Linear)
+    }
+}
+
+
+// Algorithm R reservoir sampling over the buffered points from first on.  seen
+// counts the points offered to the reservoir so far; while fewer than
+// max_points have been seen, points are kept as they are, and after that
+// the t-th point replaces a random slot with probability max_points / t.
+// The buffer is then cut back to max_points.
+void PrcWriter::samplePoints(point_count_t first, point_count_t& seen)
+{
+    const point_count_t numBuffered = m_xyz.size() / 3;
+
+    for (point_count_t i = first; i < numBuffered; ++i)
+    {
+        ++seen;
+        if (i < m_maxPoints)
+            continue;
+
+        // The modulo bias is negligible with a 64-bit generator, and unlike
+        // std::uniform_int_distribution this is the same on every platform.
+        point_count_t slot = m_rng() % seen;
+        if (slot < m_maxPoints)
         {
-            range = m_bounds.maxz - m_bounds.minz;
-            step = range / 9;
-            t0 = m_bounds.minz + 1 * step;
-            t1 = m_bounds.minz + 2 * step;
-            t2 = m_bounds.minz + 3 * step;
-            t3 = m_bounds.minz + 4 * step;
-            t4 = m_bounds.minz + 5 * step;
-            t5 = m_bounds.minz + 6 * step;
-            t6 = m_bounds.minz + 7 * step;
-            t7 = m_bounds.minz + 8 * step;
+            std::memcpy(m_xyz.data() + 3 * slot, m_xyz.data() + 3 * i,
+                3 * sizeof(double));
+            if (!m_colors.empty())
+                m_colors[slot] = m_colors[i];
+            if (!m_values.empty())
+                m_values[slot] = m_values[i];
         }
+    }
 
-        char msg[1000];
-        sprintf(msg, "z stats %f, %f, %f, %f, %f, %f, %f, %f, %f, %f",
-                range, step, t0, t1, t2, t3, t4, t5, t6, t7);
-        log()->get(LogLevel::Debug2) << msg << std::endl ;
-        t0 -= cz;
-        t1 -= cz;
-        t2 -= cz;
-        t3 -= cz;
-        t4 -= cz;
-        t5 -= cz;
-        t6 -= cz;
-        t7 -= cz;
-
-        sprintf(msg, "z stats %f, %f, %f, %f, %f, %f, %f, %f, %f, %f",
-                range, step, t0, t1, t2, t3, t4, t5, t6, t7);
-        log()->get(LogLevel::Debug2) << msg << std::endl;
-
-        int id0, id1, id2, id3, id4, id5, id6, id7, id8;
-        id0 = id1 = id2 = id3 = id4 = id5 = id6 = id7 = id8 = 0;
-
-        for (point_count_t i = 0; i < view->size(); ++i)
+    if (numBuffered > m_maxPoints)
+    {
+        m_xyz.resize(3 * m_maxPoints);
+        if (!m_colors.empty())
+            m_colors.resize(m_maxPoints);
+        if (!m_values.empty())
+            m_values.resize(m_maxPoints);
+    }
+}
+
+
+// Take the centre from the header bounds that readers.las publishes in its
+// metadata.  If they're missing, the writer falls back to centring on the
+// bounds of the data.
+void PrcWriter::findHeaderCenter(MetadataNode root)
+{
+    MetadataNode minx = root.findChild("readers.las:minx");
+    MetadataNode miny = root.findChild("readers.las:miny");
+    MetadataNode minz = root.findChild("readers.las:minz");
+    MetadataNode maxx = root.findChild("readers.las:maxx");
+    MetadataNode maxy = root.findChild("readers.las:maxy");
+    MetadataNode maxz = root.findChild("readers.las:maxz");
+    if (!minx.valid() || !miny.valid() || !minz.valid() ||
+        !maxx.valid() || !maxy.valid() || !maxz.valid())
+    {
+        log()->get(LogLevel::Warning) << "No header bounds found; centring "
+            "on the bounds of the data." << std::endl;
+        return;
+    }
+
+    m_cx = (maxx.value<double>() - minx.value<double>()) / 2 +
+        minx.value<double>();
+    m_cy = (maxy.value<double>() - miny.value<double>()) / 2 +
+        miny.value<double>();
+    m_cz = (maxz.value<double>() - minz.value<double>()) / 2 +
+        minz.value<double>();
+    m_haveCenter = true;
+}
+
+
+// Largest power of two not above limit.
+double PrcWriter::snapStep(double limit)
+{
+    int exp;
+    std::frexp(limit, &exp);
+    return std::ldexp(1.0, exp - 1);
+}
+
+
+// Snap to the scales that readers.las publishes in its metadata.  Without
+// them, coordinates are left as they are.
+void PrcWriter::findSourceScale(MetadataNode root)
+{
+    MetadataNode sx = root.findChild("readers.las:scale_x");
+    MetadataNode sy = root.findChild("readers.las:scale_y");
+    MetadataNode sz = root.findChild("readers.las:scale_z");
+    if (!sx.valid() || !sy.valid() || !sz.valid() ||
+        sx.value<double>() <= 0 || sy.value<double>() <= 0 ||
+        sz.value<double>() <= 0)
+    {
+        log()->get(LogLevel::Warning) << "No source scale found; "
+            "coordinates won't be snapped." << std::endl;
+        return;
+    }
+
+    m_snapStep[0] = snapStep(sx.value<double>());
+    m_snapStep[1] = snapStep(sy.value<double>());
+    m_snapStep[2] = snapStep(sz.value<double>());
+}
+
+
+// Round every buffered (centred) coordinate to a multiple of its axis' snap
+// step.  The steps are powers of two, so a snapped value is a short binary
+// fraction whose low mantissa bytes are zero, and the PRC double encoding
+// drops them.  A decimal step such as 0.01 has no such representation.
+void PrcWriter::snapPoints()
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "snap",
+        m_xyz.size() * sizeof(double));
+    const point_count_t numBuffered = m_xyz.size() / 3;
+
+    forEachSlice(numBuffered, sliceCount(numBuffered),
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        double *xyz = m_xyz.data();
+        for (point_count_t i = 3 * begin; i < 3 * end; i += 3)
+            for (int axis = 0; axis < 3; ++axis)
+                xyz[i+axis] = std::round(xyz[i+axis] / m_snapStep[axis]) *
+                    m_snapStep[axis];
+    });
+}
+
+
+// Subtract the centre from every buffered coordinate.  The loop body is
+// branch-free over a flat array so the compiler can vectorize it.
+void PrcWriter::centerPoints(double cx, double cy, double cz)
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "center",
+        m_xyz.size() * sizeof(double));
+    const point_count_t numBuffered = m_xyz.size() / 3;
+
+    forEachSlice(numBuffered, sliceCount(numBuffered),
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        double *xyz = m_xyz.data();
+        for (point_count_t i = 3 * begin; i < 3 * end; i += 3)
         {
-            double xd = view->getFieldAs<double>(Dimension::Id::X, i) - cx;
-            double yd = view->getFieldAs<double>(Dimension::Id::Y, i) - cy;
-            double zd = view->getFieldAs<double>(Dimension::Id::Z, i) - cz;
-            //  if (i % 1000 == 0) printf("%f %f %f\n", xd, yd, zd);
+            xyz[i+0] -= cx;
+            xyz[i+1] -= cy;
+            xyz[i+2] -= cz;
+        }
+    });
+}
 
-            if (zd < t0)
-            {
-                p0[id0][0] = xd;
-                p0[id0][1] = yd;
-                p0[id0][2] = zd;
-                id0++;
-            }
-            else if (zd < t1)
-            {
-                p1[id1][0] = xd;
-                p1[id1][1] = yd;
-                p1[id1][2] = zd;
-                id1++;
-            }
-            else if (zd < t2)
-            {
-                p2[id2][0] = xd;
-                p2[id2][1] = yd;
-                p2[id2][2] = zd;
-                id2++;
-            }
-            else if (zd < t3)
-            {
-                p3[id3][0] = xd;
-                p3[id3][1] = yd;
-                p3[id3][2] = zd;
-                id3++;
-            }
-            else if (zd < t4)
-            {
-                p4[id4][0] = xd;
-                p4[id4][1] = yd;
-                p4[id4][2] = zd;
-                id4++;
-            }
-            else if (zd < t5)
-            {
-                p5[id5][0] = xd;
-                p5[id5][1] = yd;
-                p5[id5][2] = zd;
-                id5++;
-            }
-            else if (zd < t6)
-            {
-                p6[id6][0] = xd;
-                p6[id6][1] = yd;
-                p6[id6][2] = zd;
-                id6++;
-            }
-            else if (zd < t7)
-            {
-                p7[id7][0] = xd;
-                p7[id7][1] = yd;
-                p7[id7][2] = zd;
-                id7++;
-            }
-            else
-            {
-                p8[id8][0] = xd;
-                p8[id8][1] = yd;
-                p8[id8][2] = zd;
-                id8++;
-            }
 
-            numPoints++;
+// Two-pass counting sort of the buffered points by bin.  Each slice of the
+// buffer is classified on its own thread into slice-local counts; prefix
+// sums over (bin, slice) then give every slice its own write cursors in
+// each bin, so the scatter is parallel as well and points keep their input
+// order within a bin.  The points are scattered straight into one buffer
+// per bin, which addBinnedPoints() hands to the PRC file without copying,
+// and the point buffers are released.
+template<typename Classify>
+std::vector<std::vector<PRCVector3d>> PrcWriter::binPoints(Classify classify,
+    std::size_t numBins)
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "bin",
+        m_xyz.size() * sizeof(double));
+    const point_count_t numBuffered = m_xyz.size() / 3;
+    const unsigned numSlices = sliceCount(numBuffered, numBins);
+
+    std::vector<uint32_t> bins(numBuffered);
+    std::vector<std::vector<point_count_t>> cursors(numSlices,
+        std::vector<point_count_t>(numBins, 0));
+
+    forEachSlice(numBuffered, numSlices,
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        point_count_t *counts = cursors[slice].data();
+        for (point_count_t i = begin; i < end; ++i)
+        {
+            uint32_t bin = classify(i);
+            bins[i] = bin;
+            counts[bin]++;
         }
+    });
 
-        sprintf(msg, "ids: %d %d %d %d %d %d %d %d %d", id0, id1,
-                id2, id3, id4, id5, id6, id7, id8);
-        log()->get(LogLevel::Debug2) << msg << std::endl;
-
-        m_prcFile->addPoints(id0, const_cast<const double**>(p0), c0, 1.0);
-        m_prcFile->addPoints(id1, const_cast<const double**>(p1), c1, 1.0);
-        m_prcFile->addPoints(id2, const_cast<const double**>(p2), c2, 1.0);
-        m_prcFile->addPoints(id3, const_cast<const double**>(p3), c3, 1.0);
-        m_prcFile->addPoints(id4, const_cast<const double**>(p4), c4, 1.0);
-        m_prcFile->addPoints(id5, const_cast<const double**>(p5), c5, 1.0);
-        m_prcFile->addPoints(id6, const_cast<const double**>(p6), c6, 1.0);
-        m_prcFile->addPoints(id7, const_cast<const double**>(p7), c7, 1.0);
-        m_prcFile->addPoints(id8, const_cast<const double**>(p8), c8, 1.0);
-
-        for (point_count_t i = 0; i < view->size(); ++i)
+    std::vector<std::vector<PRCVector3d>> binned(numBins);
+    for (std::size_t bin = 0; bin < numBins; ++bin)
+    {
+        point_count_t pos = 0;
+        for (unsigned slice = 0; slice < numSlices; ++slice)
         {
-            free(p0[i]);
-            free(p1[i]);
-            free(p2[i]);
-            free(p3[i]);
-            free(p4[i]);
-            free(p5[i]);
-            free(p6[i]);
-            free(p7[i]);
-            free(p8[i]);
+            point_count_t count = cursors[slice][bin];
+            cursors[slice][bin] = pos;
+            pos += count;
         }
-        free(p0);
-        free(p1);
-        free(p2);
-        free(p3);
-        free(p4);
-        free(p5);
-        free(p6);
-        free(p7);
-        free(p8);
+        binned[bin].resize(pos);
     }
-    else
-    {
-        log()->get(LogLevel::Debug4) << "No color scheme provided." << std::endl;
 
-        bool bHaveColor(false);
-        if (view->hasDim(Dimension::Id::Red) &&
-            view->hasDim(Dimension::Id::Green) &&
-            view->hasDim(Dimension::Id::Blue))
-            bHaveColor = true;
-
-        if (bHaveColor)
+    forEachSlice(numBuffered, numSlices,
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        point_count_t *next = cursors[slice].data();
+        for (point_count_t i = begin; i < end; ++i)
         {
-            log()->get(LogLevel::Debug4) << "Using RGB." << std::endl;
+            const uint32_t bin = bins[i];
+            const double *p = m_xyz.data() + 3 * i;
+            binned[bin][next[bin]++].Set(p[0], p[1], p[2]);
+        }
+    });
+
+    std::vector<double>().swap(m_xyz);
+    std::vector<uint16_t>().swap(m_colors);
+    std::vector<double>().swap(m_values);
+    return binned;
+}
 
-            uint16_t histogram[INT16_MAX] = {0};
 
-            double xd(0.0);
-            double yd(0.0);
-            double zd(0.0);
+// Add the points binned by binPoints() with a key of group * colors.size() +
+// color, one point set per non-empty bin.  Tiles with no points at all are
+// left out.
+void PrcWriter::addBinnedPoints(const GroupLayout& layout,
+    std::vector<std::vector<PRCVector3d>>& binned,
+    const std::vector<RGBAColour>& colors, double width)
+{
+    const std::size_t numColors = colors.size();
+    const std::size_t tileBins = layout.numLevels * numColors;
 
-            for (point_count_t i = 0; i < view->size(); ++i)
+    std::vector<point_count_t> colorCounts(numColors, 0);
+    point_count_t numPoints = 0;
+    for (std::size_t bin = 0; bin < binned.size(); ++bin)
+    {
+        colorCounts[bin % numColors] += binned[bin].size();
+        numPoints += binned[bin].size();
+    }
+    std::ostringstream oss;
+    oss << "class counts:";
+    for (point_count_t count : colorCounts)
+        oss << " " << count;
+    log()->get(LogLevel::Debug2) << oss.str() << std::endl;
+
+    PRCPhaseTimer timer(&m_prcFile->stats, "add_points",
+        numPoints * sizeof(PRCVector3d));
+    for (unsigned tile = 0; tile < layout.numTiles(); ++tile)
+    {
+        const std::size_t first = tile * tileBins;
+        bool empty = true;
+        for (std::size_t bin = first; bin < first + tileBins; ++bin)
+            empty = empty && binned[bin].empty();
+        if (empty)
+            continue;
+
+        for (unsigned lod = 0; lod < layout.numLevels; ++lod)
+        {
+            beginGroup(layout, tile, lod);
+            for (std::size_t color = 0; color < numColors; ++color)
             {
-                uint16_t r = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Red, i);
-                uint16_t g = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Green, i);
-                uint16_t b = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Blue, i);
-                uint16_t color = RGB(r, g, b);
-                histogram[color]++;
+                std::vector<PRCVector3d>& points =
+                    binned[first + lod * numColors + color];
+                if (points.size() <= UINT32_MAX)
+                {
+                    if (!points.empty())
+                        m_prcFile->addPoints(std::move(points),
+                            colors[color], width);
+                    continue;
+                }
+
+                // A point set holds at most UINT32_MAX points, so a larger
+                // bin is split over several.
+                const double *xyz =
+                    reinterpret_cast<const double*>(points.data());
+                for (point_count_t pos = 0; pos < points.size();)
+                {
+                    point_count_t count = std::min<point_count_t>(
+                        points.size() - pos, UINT32_MAX);
+                    m_prcFile->addPoints(static_cast<uint32_t>(count),
+                        xyz + 3 * pos, colors[color], width);
+                    pos += count;
+                }
+                std::vector<PRCVector3d>().swap(points);
             }
+            endGroup(layout, lod);
+        }
+        // With a point set memory limit a tile's sets leave memory as soon as
+        // its group is closed, rather than once the limit is crossed.
+        if (layout.numTiles() > 1)
+            m_prcFile->spillPointSets();
+    }
+}
 
-            byte colMap[256][3];
-            ColorQuantizer *colorQuantizer = new ColorQuantizer();
-            // is there any chance that this won't return 256 cubes? should we check?
-            word ncubes = colorQuantizer->medianCut(histogram, colMap, 256);
 
-            std::vector<std::vector<int> > indices;
-            indices.resize(256);
+// Most colours the points can be drawn with: the ramp's classes, the
+// palette's entries or the one solid colour.
+std::size_t PrcWriter::maxColors() const
+{
+    if (m_colorScheme == ColorScheme::Oranges ||
+            m_colorScheme == ColorScheme::BlueGreen)
+        return m_colorClasses;
+    if (!m_haveColor)
+        return 1;
+    if (m_colorPalette == ColorPalette::Rgb444)
+        return 4096;
+    if (m_colorPalette == ColorPalette::Rgb332)
+        return 256;
+    return MAXCOLORS;
+}
 
-            for (point_count_t i = 0; i < view->size(); ++i)
-            {
-                uint16_t r = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Red, i);
-                uint16_t g = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Green, i);
-                uint16_t b = view->getFieldAs<uint16_t>(
-                    Dimension::Id::Blue, i);
-                uint16_t color = RGB(r, g, b);
-                uint16_t colorIndex = histogram[color];
-                indices[colorIndex].push_back(i);
-            }
 
-            for (uint32_t level = 0; level < 256; ++level)
-            {
-                int num_points = indices[level].size();
+void PrcWriter::checkBins(std::size_t numTiles, std::size_t numColors) const
+{
+    const std::size_t numLevels = std::max(1u, m_octreeLevels);
+    if (numTiles * numLevels * numColors > MaxBins)
+        throw pdal_error("Tiles, octree levels and colours make more than " +
+            std::to_string(MaxBins) + " bins; use fewer tiles, levels or "
+            "colour classes.");
+}
 
-                double **points;
 
-                // Allocate memory
-                points = new double*[num_points];
-                for (int point = 0; point < num_points; ++point)
-                {
-                    points[point] = new double[3];
+// Octree level of each buffered (centred) point.
+std::vector<uint8_t> PrcWriter::buildLevels(double cx, double cy, double cz)
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "octree",
+        m_xyz.size() * sizeof(double));
+    const point_count_t numBuffered = m_xyz.size() / 3;
+
+    double min[3] = { m_bounds.minx - cx, m_bounds.miny - cy,
+        m_bounds.minz - cz };
+    double extent = std::max(m_bounds.maxx - m_bounds.minx,
+        std::max(m_bounds.maxy - m_bounds.miny, m_bounds.maxz - m_bounds.minz));
+    double spacing = m_octreeSpacing > 0 ? m_octreeSpacing : extent / 128;
+    if (spacing <= 0)
+        spacing = 1;
+
+    // The finest sampled level must still fit the cell index.
+    double finest = std::ldexp(spacing, -static_cast<int>(m_octreeLevels - 2));
+    if (extent / finest >= std::ldexp(1.0, OctreeBuilder::CellBits))
+        throw pdal_error("Option 'octree_spacing' is too small for " +
+            std::to_string(m_octreeLevels) + " octree levels.");
+
+    OctreeBuilder tree(min, spacing, m_octreeLevels);
+    std::vector<uint8_t> levels(numBuffered);
+    std::vector<point_count_t> counts(m_octreeLevels, 0);
+    for (point_count_t i = 0; i < numBuffered; ++i)
+    {
+        levels[i] = tree.insert(m_xyz.data() + 3 * i);
+        counts[levels[i]]++;
+    }
 
-                    int idx = indices[level][point];
+    std::ostringstream oss;
+    oss << "octree level counts:";
+    for (point_count_t count : counts)
+        oss << " " << count;
+    log()->get(LogLevel::Debug2) << oss.str() << std::endl;
 
-                    xd = view->getFieldAs<double>(Dimension::Id::X, idx) - cx;
-                    yd = view->getFieldAs<double>(Dimension::Id::Y, idx) - cy;
-                    zd = view->getFieldAs<double>(Dimension::Id::Z, idx) - cz;
+    return levels;
+}
 
-                    points[point][0] = xd;
-                    points[point][1] = yd;
-                    points[point][2] = zd;
-                    numPoints++;
-                }
 
-                double r = static_cast<double>((int)(colMap[level][0])/255.0);
-                double g = static_cast<double>((int)(colMap[level][1])/255.0);
-                double b = static_cast<double>((int)(colMap[level][2])/255.0);
+// Number of slices numPoints points are split into, one per thread.  When
+// each slice keeps numCounters counters of its own, a slice gets at least as
+// many points as counters, so the counters never outgrow the points.
+unsigned PrcWriter::sliceCount(point_count_t numPoints,
+    std::size_t numCounters) const
+{
+    // Below this many points per slice a thread costs more than it saves.
+    const point_count_t MinSlicePoints = 65536;
 
-                m_prcFile->addPoints(num_points,
-                                     const_cast<const double**>(points),
-                                     RGBAColour(r, g, b, 1.0), 5.0);
+    point_count_t slices = std::max<point_count_t>(1, numPoints /
+        std::max<point_count_t>(MinSlicePoints, numCounters));
+    return static_cast<unsigned>(std::min<point_count_t>(slices, m_threads));
+}
 
-                // De-Allocate memory to prevent memory leak
-                for (int point = 0; point < num_points; ++point)
-                {
-                    delete [] points[point];
-                }
-                delete [] points;
-            }
+
+// 15-bit colour key of a packed RGB triplet (see RGB() in ColorQuantizer.hpp,
+// which takes 8-bit components).  While the component size is being
+// detected, the first component above 255 switches to 16 bits.
+uint16_t PrcWriter::colorKey(const uint16_t rgb[3])
+{
+    if (m_detectColorBits && std::max({ rgb[0], rgb[1], rgb[2] }) > 255)
+        widenColors();
+    const int shift = m_colorShift;
+    return RGB(std::min(rgb[0] >> shift, 255),
+        std::min(rgb[1] >> shift, 255), std::min(rgb[2] >> shift, 255));
+}
+
+
+// Take the input's colours to have 16-bit components from now on.  Every
+// colour buffered so far fit in 8 bits, so shifted down by 8 it is black.
+void PrcWriter::widenColors()
+{
+    log()->get(LogLevel::Debug2) << "Found RGB above 255; taking 16-bit "
+        "components." << std::endl;
+    m_detectColorBits = false;
+    m_colorShift = 8;
+    std::fill(m_colors.begin(), m_colors.end(), 0);
+
+    // Voxels told apart only by colour now share a key.  The first keeps it;
+    // the points already kept for the others stay in the buffer.
+    if (!m_voxels.empty())
+    {
+        decltype(m_voxels) voxels;
+        voxels.reserve(m_voxels.size());
+        for (const auto& voxel : m_voxels)
+        {
+            VoxelKey key = voxel.first;
+            key.color = 0;
+            voxels.insert(std::make_pair(key, voxel.second));
         }
-        else
+        m_voxels.swap(voxels);
+    }
+}
+
+
+// Build the palette the buffered colours are drawn with, and a table from
+// colour key to palette index.  The fixed palettes need no pass over the
+// data.  Otherwise the keys are counted; if there are no more distinct keys
+// than the palette holds, each gets its own entry and median cut is skipped.
+void PrcWriter::buildPalette(std::vector<uint16_t>& lut,
+    std::vector<RGBAColour>& palette)
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "palette",
+        m_colors.size() * sizeof(uint16_t));
+
+    if (m_colorPalette == ColorPalette::Rgb332 ||
+        m_colorPalette == ColorPalette::Rgb444)
+    {
+        // Red, green and blue bits of the palette index.
+        const bool rgb332 = (m_colorPalette == ColorPalette::Rgb332);
+        const int rb = rgb332 ? 3 : 4;
+        const int gb = rgb332 ? 3 : 4;
+        const int bb = rgb332 ? 2 : 4;
+
+        palette.resize(std::size_t(1) << (rb + gb + bb));
+        for (std::size_t idx = 0; idx < palette.size(); ++idx)
         {
-            log()->get(LogLevel::Debug4) << "Using solid color." << std::endl;
+            // Entries sit at the centre of their bin.
+            int r = int(idx >> (gb + bb));
+            int g = int(idx >> bb) & ((1 << gb) - 1);
+            int b = int(idx) & ((1 << bb) - 1);
+            palette[idx] = RGBAColour(
+                ((r << (8 - rb)) + (1 << (7 - rb))) / 255.0,
+                ((g << (8 - gb)) + (1 << (7 - gb))) / 255.0,
+                ((b << (8 - bb)) + (1 << (7 - bb))) / 255.0, 1.0);
+        }
+        for (int key = 0; key < HSIZE; ++key)
+            lut[key] = ((RED(key) >> (8 - rb)) << (gb + bb)) |
+                ((GREEN(key) >> (8 - gb)) << bb) | (BLUE(key) >> (8 - bb));
+        return;
+    }
+
+    const point_count_t numBuffered = m_colors.size();
+    const unsigned numSlices = sliceCount(numBuffered);
+    std::vector<std::vector<uint32_t>> partial(numSlices,
+        std::vector<uint32_t>(HSIZE, 0));
+    forEachSlice(numBuffered, numSlices,
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        uint32_t *counts = partial[slice].data();
+        for (point_count_t i = begin; i < end; ++i)
+            counts[m_colors[i]]++;
+    });
+
+    // The quantizer takes 16-bit counts, so they saturate rather than wrap.
+    std::vector<word> histogram(HSIZE, 0);
+    std::size_t distinct = 0;
+    for (int color = 0; color < HSIZE; ++color)
+    {
+        uint64_t count = 0;
+        for (unsigned slice = 0; slice < numSlices; ++slice)
+            count += partial[slice][color];
+        histogram[color] = static_cast<word>(
+            std::min<uint64_t>(count, UINT16_MAX));
+        if (count)
+            distinct++;
+    }
 
-            double **points;
-            points = (double**) malloc(view->size()*sizeof(double*));
-            for (point_count_t i = 0; i < view->size(); ++i)
+    if (distinct <= MAXCOLORS)
+    {
+        log()->get(LogLevel::Debug4) << "Using exact palette of " <<
+            distinct << " colors." << std::endl;
+        for (int color = 0; color < HSIZE; ++color)
+            if (histogram[color])
             {
-                points[i] = (double*) malloc(3*sizeof(double));
+                lut[color] = static_cast<uint16_t>(palette.size());
+                palette.push_back(RGBAColour(RED(color) / 255.0,
+                    GREEN(color) / 255.0, BLUE(color) / 255.0, 1.0));
             }
+        return;
+    }
 
-            double xd(0.0);
-            double yd(0.0);
-            double zd(0.0);
+    byte colMap[MAXCOLORS][3];
+    ColorQuantizer colorQuantizer;
+    word ncubes = colorQuantizer.medianCut(histogram.data(), colMap,
+        MAXCOLORS);
 
-            for (point_count_t i = 0; i < view->size(); ++i)
-            {
-                xd = view->getFieldAs<double>(Dimension::Id::X, i) - cx;
-                yd = view->getFieldAs<double>(Dimension::Id::Y, i) - cy;
-                zd = view->getFieldAs<double>(Dimension::Id::Z, i) - cz;
+    // medianCut leaves the cube index of each colour in the histogram.
+    lut.assign(histogram.begin(), histogram.end());
+    for (word cube = 0; cube < ncubes; ++cube)
+    {
+        double r = static_cast<double>((int)(colMap[cube][0])/255.0);
+        double g = static_cast<double>((int)(colMap[cube][1])/255.0);
+        double b = static_cast<double>((int)(colMap[cube][2])/255.0);
+        palette.push_back(RGBAColour(r, g, b, 1.0));
+    }
+}
 
-                if (i % 10000 == 0)
-                {
-                    char msg[1000];
-                    sprintf(msg, "small point %f %f %f", xd, yd, zd);
-                    log()->get(LogLevel::Debug2) << msg << std::endl;
-                }
-                points[i][0] = xd;
-                points[i][1] = yd;
-                points[i][2] = zd;
 
-                numPoints++;
-            }
+// Histogram of the colour dimension over [lo, hi] in HistogramBins equal
+// bins.  Each slice counts into its own partial histogram, and the partials
+// are summed, so there is no sort and no shared counter.  Z is counted in
+// the original frame: cz is added back to the centred coordinate.
+std::vector<uint64_t> PrcWriter::valueHistogram(double lo, double hi,
+    double cz)
+{
+    PRCPhaseTimer timer(&m_prcFile->stats, "histogram",
+        m_xyz.size() * sizeof(double) + m_values.size() * sizeof(double));
+    const point_count_t numBuffered = m_xyz.size() / 3;
+    const bool byZ = (m_colorDim == Dimension::Id::Z);
+    const double scale = (hi > lo) ? HistogramBins / (hi - lo) : 0;
+
+    const unsigned numSlices = sliceCount(numBuffered);
+    std::vector<std::vector<uint64_t>> partial(numSlices,
+        std::vector<uint64_t>(HistogramBins, 0));
+    forEachSlice(numBuffered, numSlices,
+        [&](unsigned slice, point_count_t begin, point_count_t end)
+    {
+        uint64_t *counts = partial[slice].data();
+        for (point_count_t i = begin; i < end; ++i)
+        {
+            double v = byZ ? m_xyz[3*i+2] + cz : m_values[i];
+            double bin = (v - lo) * scale;
+            counts[bin < HistogramBins ? static_cast<std::size_t>(bin) :
+                HistogramBins - 1]++;
+        }
+    });
 
-            m_prcFile->addPoints(numPoints, const_cast<const double**>(points),
-                                 RGBAColour(1.0,1.0,0.0,1.0),1.0);
+    std::vector<uint64_t> hist(HistogramBins, 0);
+    for (unsigned slice = 0; slice < numSlices; ++slice)
+        for (std::size_t bin = 0; bin < HistogramBins; ++bin)
+            hist[bin] += partial[slice][bin];
+    return hist;
+}
 
-            for (point_count_t i = 0; i < view->size(); ++i)
-            {
-                free(points[i]);
-            }
-            free(points);
+
+// Open the groups for octree level lod of tile.  A tile group is opened
+// with its first level; without tiles or an octree the points go straight
+// into the "points" group.
+void PrcWriter::beginGroup(const GroupLayout& layout, unsigned tile,
+    unsigned lod)
+{
+    PRCoptions grpopt = groupOptions();
+    if (layout.numTiles() > 1 && lod == 0)
+    {
+        std::string name = "tile_" + std::to_string(tile % layout.tilesX) +
+            "_" + std::to_string(tile / layout.tilesX);
+        m_prcFile->begingroup(name.c_str(), &grpopt);
+    }
+    if (layout.numLevels > 1)
+    {
+        std::string name = "lod" + std::to_string(lod);
+        m_prcFile->begingroup(name.c_str(), &grpopt);
+    }
+}
+
+
+void PrcWriter::endGroup(const GroupLayout& layout, unsigned lod)
+{
+    if (layout.numLevels > 1)
+        m_prcFile->endgroup();
+    if (layout.numTiles() > 1 && lod + 1 == layout.numLevels)
+        m_prcFile->endgroup();
+}
+
+
+void PrcWriter::flushPoints()
+{
+    if (m_xyz.empty())
+        return;
+
+    // Once points are binned their colours are fixed, so any later ones are
+    // read with the same component size.
+    m_detectColorBits = false;
+
+    // Voxels map to buffer slots, so with voxels the budget is applied to the
+    // decimated points here rather than as they arrive.
+    if (m_maxPoints && m_voxelSize > 0)
+    {
+        PRCPhaseTimer timer(&m_prcFile->stats, "sample",
+            m_xyz.size() * sizeof(double));
+        point_count_t seen = 0;
+        samplePoints(0, seen);
+    }
+
+    // binPoints() releases the buffer, so count what is written first.
+    m_pointCount += m_xyz.size() / 3;
+
+    double zmin = m_bounds.minz;
+    double zmax = m_bounds.maxz;
+    double cz2 = (zmax-zmin)/2+zmin;
+    HPDF_REAL cooz = static_cast<HPDF_REAL>(cz2);
+
+    char msg[1000];
+    sprintf(msg, "cz: %f, min: %f, max: %f, cooz: %f", cz2, zmin, zmax, cooz);
+    log()->get(LogLevel::Debug2) << msg << std::endl ;
+
+    double cx = (m_bounds.maxx-m_bounds.minx)/2+m_bounds.minx;
+    double cy = (m_bounds.maxy-m_bounds.miny)/2+m_bounds.miny;
+    double cz = (m_bounds.maxz-m_bounds.minz)/2+m_bounds.minz;
+
+    // Points were centred as they arrived when the centre came from the
+    // header.
+    if (m_haveCenter)
+    {
+        cx = m_cx;
+        cy = m_cy;
+        cz = m_cz;
+    }
+    else
+        centerPoints(cx, cy, cz);
+
+    if (m_snapStep[0] > 0)
+        snapPoints();
+
+    // Each tile, and each octree level within a tile, goes into a group of
+    // its own, so tile and level are the leading bin keys.
+    GroupLayout layout;
+    layout.tilesX = 1;
+    layout.tilesY = 1;
+    layout.numLevels = 1;
+
+    std::vector<uint8_t> levels;
+    if (m_octreeLevels > 1)
+    {
+        levels = buildLevels(cx, cy, cz);
+        layout.numLevels = m_octreeLevels;
+    }
+
+    double width = m_bounds.maxx - m_bounds.minx;
+    double height = m_bounds.maxy - m_bounds.miny;
+    if (m_tileSize > 0)
+    {
+        double tilesX = std::max(1.0, std::ceil(width / m_tileSize));
+        double tilesY = std::max(1.0, std::ceil(height / m_tileSize));
+        if (tilesX * tilesY > MaxTiles)
+            throw pdal_error("Option 'tile_size' gives more than " +
+                std::to_string(MaxTiles) + " tiles.");
+        layout.tilesX = static_cast<unsigned>(tilesX);
+        layout.tilesY = static_cast<unsigned>(tilesY);
+        checkBins(layout.numTiles(), maxColors());
+        width = m_tileSize;
+        height = m_tileSize;
+    }
+    else if (m_tileCount > 1)
+    {
+        layout.tilesX = m_tileCount;
+        layout.tilesY = m_tileCount;
+        width /= m_tileCount;
+        height /= m_tileCount;
+    }
+    const double tileMinX = m_bounds.minx - cx;
+    const double tileMinY = m_bounds.miny - cy;
+    auto tileOf = [&](point_count_t i) -> uint32_t
+    {
+        if (layout.numTiles() == 1)
+            return 0;
+        double tx = width > 0 ? (m_xyz[3*i+0] - tileMinX) / width : 0;
+        double ty = height > 0 ? (m_xyz[3*i+1] - tileMinY) / height : 0;
+        uint32_t ix = std::min<uint32_t>(static_cast<uint32_t>(tx),
+            layout.tilesX - 1);
+        uint32_t iy = std::min<uint32_t>(static_cast<uint32_t>(ty),
+            layout.tilesY - 1);
+        return iy * layout.tilesX + ix;
+    };
+    auto groupOf = [&](point_count_t i) -> uint32_t
+    {
+        return tileOf(i) * layout.numLevels +
+            (levels.empty() ? 0 : levels[i]);
+    };
+    const std::size_t numGroups = layout.numTiles() * layout.numLevels;
+
+    if ((m_colorScheme == ColorScheme::Oranges) ||
+            (m_colorScheme == ColorScheme::BlueGreen))
+    {
+        ColorRamp ramp(m_colorScheme == ColorScheme::Oranges ?
+            ColorRamp::oranges() : ColorRamp::blueGreen(), m_colorClasses);
+
+        const bool byZ = (m_colorDim == Dimension::Id::Z);
+        const double lo = byZ ? m_bounds.minz : m_valueMin;
+        const double hi = byZ ? m_bounds.maxz : m_valueMax;
+        if (m_contrastStretch == ContrastStretch::Sqrt)
+            ramp.setSqrt(lo, hi);
+        else if (m_contrastStretch == ContrastStretch::Equalize)
+            ramp.setEqualized(valueHistogram(lo, hi, cz), lo, hi);
+        else if (m_contrastStretch == ContrastStretch::Percentile)
+        {
+            std::vector<uint64_t> hist = valueHistogram(lo, hi, cz);
+            double clip = m_clipPercent / 100.0;
+            ramp.setLinear(ColorRamp::quantile(hist, lo, hi, clip),
+                ColorRamp::quantile(hist, lo, hi, 1.0 - clip));
+        }
+        else
+            ramp.setLinear(lo, hi);
+
+        std::ostringstream oss;
+        oss << m_colorDimName << " thresholds:";
+        for (double t : ramp.thresholds())
+            oss << " " << t;
+        log()->get(LogLevel::Debug2) << oss.str() << std::endl;
+
+        // Points are compared in the centred frame.
+        if (byZ)
+            ramp.translate(-cz);
+
+        // Integer dimensions with a modest range are classified through a
+        // table built once from the ramp.
+        std::vector<uint16_t> lut;
+        const int64_t lutMin = byZ ? 0 : static_cast<int64_t>(lo);
+        if (!byZ && m_valueIsInteger && hi - lo < MaxValueLut)
+        {
+            lut.resize(static_cast<std::size_t>(hi - lo) + 1);
+            for (std::size_t k = 0; k < lut.size(); ++k)
+                lut[k] = ramp.classify(static_cast<double>(lutMin + k));
+        }
+        auto classify = [&](point_count_t i) -> uint16_t
+        {
+            if (byZ)
+                return ramp.classify(m_xyz[3*i+2]);
+            if (!lut.empty())
+                return lut[static_cast<int64_t>(m_values[i]) - lutMin];
+            return ramp.classify(m_values[i]);
+        };
+
+        const std::size_t numClasses = ramp.size();
+        std::vector<std::vector<PRCVector3d>> binned = binPoints(
+            [&](point_count_t i) { return static_cast<uint32_t>(
+                groupOf(i) * numClasses + classify(i)); },
+            numGroups * numClasses);
+        addBinnedPoints(layout, binned, ramp.colours(), 1.0);
+    }
+    else
+    {
+        log()->get(LogLevel::Debug4) << "No color scheme provided." << std::endl;
+
+        if (m_haveColor)
+        {
+            log()->get(LogLevel::Debug4) << "Using RGB." << std::endl;
+
+            std::vector<uint16_t> lut(HSIZE, 0);
+            std::vector<RGBAColour> palette;
+            buildPalette(lut, palette);
+
+            const std::size_t numColors = palette.size();
+            std::vector<std::vector<PRCVector3d>> binned = binPoints(
+                [&](point_count_t i) { return static_cast<uint32_t>(
+                    groupOf(i) * numColors + lut[m_colors[i]]); },
+                numGroups * numColors);
+            addBinnedPoints(layout, binned, palette, 5.0);
+        }
+        else
+        {
+            log()->get(LogLevel::Debug4) << "Using solid color." << std::endl;
+
+            std::vector<std::vector<PRCVector3d>> binned =
+                binPoints(groupOf, numGroups);
+            addBinnedPoints(layout, binned,
+                std::vector<RGBAColour>(1, RGBAColour(1.0,1.0,0.0,1.0)), 1.0);
         }
     }
+
+    m_xyz.clear();
+    m_xyz.shrink_to_fit();
+    m_colors.clear();
+    m_colors.shrink_to_fit();
+    m_values.clear();
+    m_values.shrink_to_fit();
+    m_valueMin = std::numeric_limits<double>::max();
+    m_valueMax = std::numeric_limits<double>::lowest();
+    m_voxels.clear();
+    m_voxelCounts.clear();
+    m_voxelCounts.shrink_to_fit();
+    m_sampled = 0;
 }
 
 std::istream& operator>>(std::istream& in, PrcWriter::OutputFormat& fmt)
@@ -637,6 +1469,10 @@ std::istream& operator>>(std::istream& in, PrcWriter::ContrastStretch& cs)
         cs = PrcWriter::ContrastStretch::Linear;
     else if (s == "sqrt")
         cs = PrcWriter::ContrastStretch::Sqrt;
+    else if (s == "equalize")
+        cs = PrcWriter::ContrastStretch::Equalize;
+    else if (s == "percentile")
+        cs = PrcWriter::ContrastStretch::Percentile;
     else
         in.setstate(std::ios::failbit);
     return in;
@@ -649,8 +1485,79 @@ std::ostream& operator<<(std::ostream& out,
     {
     case PrcWriter::ContrastStretch::Linear:
         out << "Linear";
+        break;
     case PrcWriter::ContrastStretch::Sqrt:
         out << "Sqrt";
+        break;
+    case PrcWriter::ContrastStretch::Equalize:
+        out << "Equalize";
+        break;
+    case PrcWriter::ContrastStretch::Percentile:
+        out << "Percentile";
+        break;
+    }
+    return out;
+}
+
+std::istream& operator>>(std::istream& in, PrcWriter::VoxelMethod& vm)
+{
+    std::string s;
+    in >> s;
+
+    s = Utils::tolower(s);
+    if (s == "first")
+        vm = PrcWriter::VoxelMethod::First;
+    else if (s == "centroid")
+        vm = PrcWriter::VoxelMethod::Centroid;
+    else
+        in.setstate(std::ios::failbit);
+    return in;
+}
+
+std::ostream& operator<<(std::ostream& out, const PrcWriter::VoxelMethod& vm)
+{
+    switch (vm)
+    {
+    case PrcWriter::VoxelMethod::First:
+        out << "First";
+        break;
+    case PrcWriter::VoxelMethod::Centroid:
+        out << "Centroid";
+        break;
+    }
+    return out;
+}
+
+std::istream& operator>>(std::istream& in, PrcWriter::ColorPalette& cp)
+{
+    std::string s;
+    in >> s;
+
+    s = Utils::tolower(s);
+    if (s == "median_cut")
+        cp = PrcWriter::ColorPalette::MedianCut;
+    else if (s == "rgb332")
+        cp = PrcWriter::ColorPalette::Rgb332;
+    else if (s == "rgb444")
+        cp = PrcWriter::ColorPalette::Rgb444;
+    else
+        in.setstate(std::ios::failbit);
+    return in;
+}
+
+std::ostream& operator<<(std::ostream& out, const PrcWriter::ColorPalette& cp)
+{
+    switch (cp)
+    {
+    case PrcWriter::ColorPalette::MedianCut:
+        out << "median_cut";
+        break;
+    case PrcWriter::ColorPalette::Rgb332:
+        out << "rgb332";
+        break;
+    case PrcWriter::ColorPalette::Rgb444:
+        out << "rgb444";
+        break;
     }
     return out;
 }
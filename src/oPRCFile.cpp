@@ -28,13 +28,14 @@
 ******************************************************************************/
 
 #include <prc/oPRCFile.hpp>
+#include <prc/PRCjobQueue.hpp>
+#include <algorithm>
 #include <time.h>
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <iomanip>
 #include <string>
-#include <zlib.h>
 #include <string.h>
 
 #define WriteUnsignedInteger( value ) out << (uint32_t)(value);
@@ -75,7 +76,13 @@
     WriteUncompressedBlock ((*it)->data, (*it)->file_size) \
   } \
  }
-#define SerializeModelFileData serializeModelFileData(modelFile_out); modelFile_out.compress();
+#define SerializeModelFileData \
+ { \
+  { PRCPhaseTimer timer(&stats, "serialize_model_file"); serializeModelFileData(modelFile_out); } \
+  PRCPhaseTimer timer(&stats, "compress_model_file", modelFile_out.getSize()); \
+  modelFile_out.compress(); \
+  timer.setBytesOut(modelFile_out.getSize()); \
+ }
 #define SerializeUnit( value ) (value).serializeUnit(out);
 
 using std::string;
@@ -318,20 +325,38 @@ void PRCFileStructure::write(std::ostream &out)
   // SerializeFileStructureHeader
   SerializeStartHeader
   SerializeUncompressedFiles
+  // each section is written once; free it as soon as it is out
   globals_out.write(out);
+  globals_out.release();
   tree_out.write(out);
+  tree_out.release();
   tessellations_out.write(out);
+  tessellations_out.release();
   geometry_out.write(out);
+  geometry_out.release();
   extraGeometry_out.write(out);
+  extraGeometry_out.release();
 }
 
-#define SerializeFileStructureGlobals serializeFileStructureGlobals(globals_out); globals_out.compress(); sizes[1]=globals_out.getSize();
-#define SerializeFileStructureTree serializeFileStructureTree(tree_out); tree_out.compress(); sizes[2]=tree_out.getSize();
-#define SerializeFileStructureTessellation serializeFileStructureTessellation(tessellations_out); tessellations_out.compress(); sizes[3]=tessellations_out.getSize();
-#define SerializeFileStructureGeometry serializeFileStructureGeometry(geometry_out); geometry_out.compress(); sizes[4]=geometry_out.getSize();
-#define SerializeFileStructureExtraGeometry serializeFileStructureExtraGeometry(extraGeometry_out); extraGeometry_out.compress(); sizes[5]=extraGeometry_out.getSize();
+// Stats of the section being prepared, when stats is set.
+#define SectionStats(index) (stats ? &section_stats[index] : NULL)
+// Serialize a section on this thread, then queue its compression.
+#define PrepareSection(name, serialize, stream, index) \
+ { \
+  { PRCPhaseTimer timer(SectionStats(index), "serialize_" name); serialize(stream); } \
+  jobs.push([&, this]() { \
+    PRCPhaseTimer timer(SectionStats(index), "compress_" name, stream.getSize()); \
+    stream.compress(); \
+    sizes[index]=stream.getSize(); \
+    timer.setBytesOut(sizes[index]); \
+  }); \
+ }
+#define SerializeFileStructureGlobals PrepareSection("globals", serializeFileStructureGlobals, globals_out, 1)
+#define SerializeFileStructureTree PrepareSection("tree", serializeFileStructureTree, tree_out, 2)
+#define SerializeFileStructureGeometry PrepareSection("geometry", serializeFileStructureGeometry, geometry_out, 4)
+#define SerializeFileStructureExtraGeometry PrepareSection("extra_geometry", serializeFileStructureExtraGeometry, extraGeometry_out, 5)
 #define FlushSerialization resetGraphicsAndName();
-void PRCFileStructure::prepare()
+void PRCFileStructure::prepare(PRCStats *stats, unsigned threads)
 {
   uint32_t size = 0;
   size += getStartHeaderSize();
@@ -340,20 +365,69 @@ void PRCFileStructure::prepare()
     size += (*it)->getSize();
   sizes[0]=size;
 
+  // Reserve the raw size of the points and of the tessellation coordinates,
+  // which make up nearly all of the two sections that grow large.
+  uint64_t tree_hint = 0;
+  for(PRCPartDefinitionList::const_iterator pit = part_definitions.begin(); pit != part_definitions.end(); ++pit)
+    for(PRCRepresentationItemList::const_iterator it = (*pit)->representation_item.begin(); it != (*pit)->representation_item.end(); ++it)
+      if((*it)->getType() == PRC_TYPE_RI_PointSet)
+      {
+        const PRCPointSet *pointset = static_cast<const PRCPointSet*>(*it);
+        tree_hint += (pointset->point.size()+pointset->spill_count)*sizeof(PRCVector3d);
+      }
+  tree_out.setSizeHint(tree_hint);
+  uint64_t tessellations_hint = 0;
+  for(PRCTessList::const_iterator it = tessellations.begin(); it != tessellations.end(); ++it)
+    tessellations_hint += (*it)->coordinates.size()*sizeof(double);
+  tessellations_out.setSizeHint(tessellations_hint);
+
+  // Each section is compressed on a worker while the next is serialized.
+  // Serializing uses the unique ID counters and the name and graphics state
+  // of writePRC.cpp, so the sections are serialized in order on this thread.
+  // The tessellations take no IDs and that state is per thread, so they are
+  // serialized on a worker from the start.  Every section starts from reset
+  // state, whichever thread serializes it and in whatever order, so the
+  // bytes do not depend on threads.  Every job keeps its own stats, added up
+  // in section order at the end.
+  // Only the tree, with the points, and the tessellations grow past
+  // PRC_DEFLATE_BLOCK and are cut into blocks compressed in parallel.  The
+  // small sections finish quickly and their workers then just wait, so the
+  // large ones share all the threads.
+  PRCStats section_stats[6];
+  const unsigned section_workers = threads > 1 ? std::min(threads-1, 5u) : 0;
+  const unsigned large_sections = (tree_hint > PRC_DEFLATE_BLOCK ? 1 : 0) +
+                                  (tessellations_hint > PRC_DEFLATE_BLOCK ? 1 : 0);
+  const unsigned block_threads = std::max(1u, threads/std::max(1u, large_sections));
+  PRCJobQueue jobs(section_workers);
+  tree_out.setCompressionThreads(block_threads);
+  tessellations_out.setCompressionThreads(block_threads);
+  jobs.push([&, this]() {
+    FlushSerialization
+    { PRCPhaseTimer timer(SectionStats(3), "serialize_tessellation"); serializeFileStructureTessellation(tessellations_out); }
+    FlushSerialization
+    PRCPhaseTimer timer(SectionStats(3), "compress_tessellation", tessellations_out.getSize());
+    tessellations_out.compress();
+    sizes[3]=tessellations_out.getSize();
+    timer.setBytesOut(sizes[3]);
+  });
+
+  FlushSerialization
   SerializeFileStructureGlobals
   FlushSerialization
 
   SerializeFileStructureTree
   FlushSerialization
 
-  SerializeFileStructureTessellation
-  FlushSerialization
-
   SerializeFileStructureGeometry
   FlushSerialization
 
   SerializeFileStructureExtraGeometry
   FlushSerialization
+
+  jobs.wait();
+  if(stats != NULL)
+    for(uint32_t i = 1; i < 6; ++i)
+      stats->add(section_stats[i]);
 }
 
 uint32_t PRCFileStructure::getSize()
@@ -408,6 +482,7 @@ uint32_t PRCHeader::getSize()
 
 void oPRCFile::doGroup(PRCgroup& group)
 {
+    PRCPhaseTimer timer(&stats, "groups");
     const string& name = group.name;
 
     PRCProductOccurrence*& product_occurrence        = group.product_occurrence;
@@ -690,6 +765,7 @@ void oPRCFile::doGroup(PRCgroup& group)
         pointset->index_of_line_style = pit->first;
         pointset->point = pit->second;
         part_definition->addPointSet(pointset);
+        point_set_count++;
       }
     }
 
@@ -698,6 +774,7 @@ void oPRCFile::doGroup(PRCgroup& group)
       for(std::vector<PRCPointSet*>::iterator pit=group.pointsets.begin(); pit!=group.pointsets.end(); pit++)
       {
         part_definition->addPointSet(*pit);
+        point_set_count++;
       }
     }
 
@@ -996,8 +1073,10 @@ std::string oPRCFile::calculate_unique_name(const ContentPRCBase *prc_entity,con
   }
   ss << (prc_entity->name.empty()?"node":prc_entity->name) << '.';
   const uint32_t size_serialization = serialization.getSize();
+  const uint8_t *serialization_data = serialization.getData();
   for(size_t j=0; j<size_serialization; j++)
-    ss << std::hex << std::setfill('0') << std::setw(2) << (uint32_t)(serialization_buffer[j]);
+    ss << std::hex << std::setfill('0') << std::setw(2) << (uint32_t)(serialization_data[j]);
+  free(serialization_buffer);
 
   return ss.str();
 }
@@ -1011,7 +1090,7 @@ bool oPRCFile::finish()
   doGroup(groups.top());
 
   // write each section's bit data
-  fileStructures[0]->prepare();
+  fileStructures[0]->prepare(&stats, threads);
   SerializeModelFileData
 
   // create the header
@@ -1047,6 +1126,8 @@ bool oPRCFile::finish()
   }
 
   // write the data
+  PRCPhaseTimer timer(&stats, "write");
+  timer.setBytesOut(header.file_size);
   header.write(output);
 
   for(uint32_t i = 0; i < number_of_file_structures; ++i)
@@ -1055,6 +1136,7 @@ bool oPRCFile::finish()
   }
 
   modelFile_out.write(output);
+  modelFile_out.release();
   output.flush();
 
   for(uint32_t i = 0; i < number_of_file_structures; ++i)
@@ -1087,7 +1169,7 @@ uint32_t PRCFileStructure::addPicture(EPRCPictureDataFormat format, uint32_t siz
   PRCUncompressedFile* uncompressed_file = new PRCUncompressedFile;
   if(format==KEPRCPicture_PNG || format==KEPRCPicture_JPG)
   {
-    data = new uint8_t[size];
+    data = (uint8_t*) malloc(size);
     memcpy(data, p, size);
     uncompressed_files.push_back(uncompressed_file);
     uncompressed_files.back()->file_size = size;
@@ -1119,48 +1201,11 @@ uint32_t PRCFileStructure::addPicture(EPRCPictureDataFormat format, uint32_t siz
         { std::cerr << "image too small" << std::endl; return m1; }
 
       {
-        uint32_t compressedDataSize = 0;
-        const int CHUNK= 1024; // is this reasonable?
-
-        z_stream strm;
-        strm.zalloc = Z_NULL;
-        strm.zfree = Z_NULL;
-        strm.opaque = Z_NULL;
-        if(deflateInit(&strm,Z_DEFAULT_COMPRESSION) != Z_OK)
-          { std::cerr << "Compression initialization failed" << std::endl; return m1; }
-        unsigned int sizeAvailable = deflateBound(&strm,size);
-        uint8_t *compressedData = (uint8_t*) malloc(sizeAvailable);
-        strm.avail_in = size;
-        strm.next_in = const_cast<unsigned char *>(p);
-        strm.next_out = (unsigned char*)compressedData;
-        strm.avail_out = sizeAvailable;
-
-        int code;
-        unsigned int chunks = 0;
-        while((code = deflate(&strm,Z_FINISH)) == Z_OK)
-        {
-          ++chunks;
-          // strm.avail_out should be 0 if we got Z_OK
-          compressedDataSize = sizeAvailable - strm.avail_out;
-          compressedData = (uint8_t*) realloc(compressedData,CHUNK*chunks);
-          strm.next_out = (Bytef*)(compressedData + compressedDataSize);
-          strm.avail_out += CHUNK;
-          sizeAvailable += CHUNK;
-        }
-        compressedDataSize = sizeAvailable-strm.avail_out;
-
-        if(code != Z_STREAM_END)
-        {
-          deflateEnd(&strm);
-          free(compressedData);
+        size_t compressedDataSize = 0;
+        data = PRCDeflate(p,size,compression_level,compressedDataSize);
+        if(data == NULL)
           { std::cerr << "Compression error" << std::endl; return m1; }
-        }
-
-        deflateEnd(&strm);
         size = compressedDataSize;
-        data = new uint8_t[compressedDataSize];
-        memcpy(data, compressedData, compressedDataSize);
-        free(compressedData);
       }
       uncompressed_files.push_back(uncompressed_file);
       uncompressed_files.back()->file_size = size;
@@ -1434,6 +1479,7 @@ void oPRCFile::begingroup(const char *name, PRCoptions *options,
                           const double* t)
 {
   const PRCgroup &parent_group = groups.top();
+  group_count++;
   groups.push(PRCgroup());
   PRCgroup &group = groups.top();
   group.name=name;
@@ -1510,6 +1556,69 @@ void oPRCFile::addPoints(uint32_t n, const double ** P, const RGBAColour &c, dou
   pointset->point.reserve(n);
   for(uint32_t i=0; i<n; i++)
     pointset->point.push_back(PRCVector3d(P[i][0],P[i][1],P[i][2]));
+  trackPointSet(pointset);
+}
+
+void oPRCFile::addPoints(uint32_t n, const double * P, const RGBAColour &c, double w)
+{
+  if(n==0 || P==NULL)
+     return;
+  PRCgroup &group = findGroup();
+  PRCPointSet *pointset = new PRCPointSet();
+  group.pointsets.push_back(pointset);
+  pointset->index_of_line_style = addColourWidth(c,w);
+  pointset->point.reserve(n);
+  for(uint32_t i=0; i<n; i++, P+=3)
+    pointset->point.push_back(PRCVector3d(P[0],P[1],P[2]));
+  trackPointSet(pointset);
+}
+
+void oPRCFile::addPoints(std::vector<PRCVector3d>&& P, const RGBAColour &c, double w)
+{
+  if(P.empty())
+     return;
+  PRCgroup &group = findGroup();
+  PRCPointSet *pointset = new PRCPointSet();
+  group.pointsets.push_back(pointset);
+  pointset->index_of_line_style = addColourWidth(c,w);
+  pointset->point = std::move(P);
+  trackPointSet(pointset);
+}
+
+void oPRCFile::trackPointSet(PRCPointSet *pointset)
+{
+  if(memory_limit == 0)
+    return;
+  resident_pointsets.push_back(pointset);
+  resident_point_bytes += pointset->point.capacity()*sizeof(PRCVector3d);
+  if(resident_point_bytes > memory_limit)
+    spillPointSets();
+}
+
+// Move every point set still in memory to the spill file.  Without a spill
+// file, or once a write to it fails, the points simply stay where they are
+// and nothing more is spilled.
+void oPRCFile::spillPointSets()
+{
+  if(memory_limit == 0 || resident_pointsets.empty())
+    return;
+  if(spill_file == NULL)
+    spill_file = tmpfile();
+  if(spill_file == NULL)
+  {
+    fputs("cannot create point set spill file; keeping points in memory\n",stderr);
+    memory_limit = 0;
+    return;
+  }
+  for(std::vector<PRCPointSet*>::iterator it=resident_pointsets.begin(); it!=resident_pointsets.end(); ++it)
+    if(!(*it)->spill(spill_file))
+    {
+      fputs("cannot write point set spill file; keeping points in memory\n",stderr);
+      memory_limit = 0;
+      break;
+    }
+  resident_pointsets.clear();
+  resident_point_bytes = 0;
 }
 
 void oPRCFile::useMesh(uint32_t tess_index, uint32_t style_index, const double origin[3], const double x_axis[3], const double y_axis[3], double scale)
@@ -20,6 +20,7 @@
 *************/
 
 #include <prc/writePRC.hpp>
+#include <algorithm>
 #include <climits>
 #include <cassert>
 
@@ -75,6 +76,9 @@ uint32_t Log2(uint32_t x)
 #define WriteDouble( value ) pbs << (double)(value);
 #define WriteBit( value ) pbs << (bool)(value);
 #define WriteBoolean( value ) pbs << (bool)(value);
+#define WriteDoubles( values, n ) pbs.writeDoubles((values), (n));
+#define WriteUnsignedIntegers( values, n ) pbs.writeUnsignedIntegers((values), (n));
+#define WriteVector3ds( xyz, n ) pbs.writeVector3ds((xyz), (n));
 #define WriteString( value ) pbs << (value);
 #define SerializeContentPRCBase serializeContentPRCBase(pbs);
 #define SerializeGraphics serializeGraphics(pbs);
@@ -503,7 +507,9 @@ void PRCStyle::serializeCategory1LineStyle(PRCbitStream &pbs)
      WriteCharacter (additional_3)
 }
 
-std::string currentName;
+// The name and graphics last written.  They are per thread so that sections
+// can be serialized concurrently.
+thread_local std::string currentName;
 
 void writeName(PRCbitStream &pbs,const std::string &name)
 {
@@ -520,9 +526,9 @@ void resetName()
   currentName = "";
 }
 
-uint32_t current_layer_index = m1;
-uint32_t current_index_of_line_style = m1;
-uint16_t current_behaviour_bit_field = 1;
+thread_local uint32_t current_layer_index = m1;
+thread_local uint32_t current_index_of_line_style = m1;
+thread_local uint16_t current_behaviour_bit_field = 1;
 
 void writeGraphics(PRCbitStream &pbs,uint32_t l,uint32_t i,uint16_t b,bool force)
 {
@@ -665,15 +671,70 @@ void  PRCPointSet::serializePointSet(PRCbitStream &pbs)
 
   SerializeRepresentationItemContent 
 
-  const uint32_t number_of_points = point.size();
+  const uint32_t number_of_points = spill_file ? spill_count : point.size();
   WriteUnsignedInteger (number_of_points)
-  for (uint32_t i=0;i<number_of_points;i++)
+  if (spill_file)
   {
-     SerializeVector3d (point[i])
+    const uint32_t block_size = 4096;
+    std::vector<double> block;
+    if (fsetpos(spill_file, &spill_pos) != 0)
+    {
+      fputs("cannot seek in point set spill file\n",stderr);
+      exit(1);
+    }
+    for (uint32_t i=0;i<number_of_points;i+=block_size)
+    {
+      const uint32_t n = std::min(block_size, number_of_points-i);
+      block.resize(3*n);
+      if (fread(block.data(), sizeof(double), 3*n, spill_file) != 3*n)
+      {
+        fputs("cannot read point set spill file\n",stderr);
+        exit(1);
+      }
+      WriteVector3ds (block.data(), n)
+    }
+  }
+  else
+  {
+    // PRCVector3d is three packed doubles
+    static_assert(sizeof(PRCVector3d) == 3*sizeof(double), "PRCVector3d is not packed");
+    WriteVector3ds (reinterpret_cast<const double*>(point.data()), number_of_points)
   }
   SerializeUserData
 }
 
+bool PRCPointSet::spill(FILE *file)
+{
+  if (spill_file || point.empty())
+    return true;
+  if (fseek(file, 0, SEEK_END) != 0 || fgetpos(file, &spill_pos) != 0)
+    return false;
+
+  const size_t block_size = 4096;
+  std::vector<double> block;
+  for (size_t i=0;i<point.size();i+=block_size)
+  {
+    const size_t n = std::min(block_size, point.size()-i);
+    block.clear();
+    for (size_t j=i;j<i+n;j++)
+    {
+      block.push_back(point[j].x);
+      block.push_back(point[j].y);
+      block.push_back(point[j].z);
+    }
+    if (fwrite(block.data(), sizeof(double), block.size(), file) != block.size())
+      return false;
+  }
+  // a full disk may only show when the buffered points are written out
+  if (fflush(file) != 0)
+    return false;
+
+  spill_file = file;
+  spill_count = point.size();
+  std::vector<PRCVector3d>().swap(point);
+  return true;
+}
+
 void  PRCSet::serializeSet(PRCbitStream &pbs)
 {
   WriteUnsignedInteger (PRC_TYPE_RI_Set)
@@ -959,8 +1020,7 @@ void  PRCContentBaseTessData::serializeContentBaseTessData(PRCbitStream &pbs)
   WriteBoolean (is_calculated)
   const uint32_t number_of_coordinates = coordinates.size();
   WriteUnsignedInteger (number_of_coordinates)
-  for (i=0;i<number_of_coordinates;i++)
-     WriteDouble (coordinates[i])
+  WriteDoubles (coordinates.data(), number_of_coordinates)
 }
 
 void  PRC3DTess::serialize3DTess(PRCbitStream &pbs)
@@ -983,19 +1043,16 @@ void  PRC3DTess::serialize3DTess(PRCbitStream &pbs)
   
   const uint32_t number_of_normal_coordinates=normal_coordinate.size();
   WriteUnsignedInteger (number_of_normal_coordinates)
-  for (i=0;i<number_of_normal_coordinates;i++)
-     WriteDouble (normal_coordinate[i])
+  WriteDoubles (normal_coordinate.data(), number_of_normal_coordinates)
   
   const uint32_t number_of_wire_indices=wire_index.size();
   WriteUnsignedInteger (number_of_wire_indices)
-  for (i=0;i<number_of_wire_indices;i++)
-     WriteUnsignedInteger (wire_index[i])
+  WriteUnsignedIntegers (wire_index.data(), number_of_wire_indices)
   
   // note : those can be single triangles, triangle fans or stripes
   const uint32_t number_of_triangulated_indices=triangulated_index.size();
   WriteUnsignedInteger (number_of_triangulated_indices)
-  for (i=0;i<number_of_triangulated_indices;i++)
-     WriteUnsignedInteger (triangulated_index[i])
+  WriteUnsignedIntegers (triangulated_index.data(), number_of_triangulated_indices)
   
   const uint32_t number_of_face_tessellation=face_tessellation.size();
   WriteUnsignedInteger (number_of_face_tessellation)
@@ -1004,8 +1061,7 @@ void  PRC3DTess::serialize3DTess(PRCbitStream &pbs)
   
   const uint32_t number_of_texture_coordinates=texture_coordinate.size();
   WriteUnsignedInteger (number_of_texture_coordinates)
-  for (i=0;i<number_of_texture_coordinates;i++)
-     WriteDouble (texture_coordinate[i])
+  WriteDoubles (texture_coordinate.data(), number_of_texture_coordinates)
 }
 
 void PRC3DTess::addTessFace(PRCTessFace*& pTessFace)
@@ -1023,8 +1079,7 @@ void  PRC3DWireTess::serialize3DWireTess(PRCbitStream &pbs)
   SerializeContentBaseTessData 
   const uint32_t number_of_wire_indexes=wire_indexes.size();
   WriteUnsignedInteger (number_of_wire_indexes)
-  for (i=0;i<number_of_wire_indexes;i++)
-     WriteUnsignedInteger (wire_indexes[i])
+  WriteUnsignedIntegers (wire_indexes.data(), number_of_wire_indexes)
   
   const bool has_vertex_colors = !rgba_vertices.empty();
   WriteBoolean (has_vertex_colors)
@@ -1055,8 +1110,7 @@ void  PRCMarkupTess::serializeMarkupTess(PRCbitStream &pbs)
 
   const uint32_t number_of_codes=codes.size();
   WriteUnsignedInteger (number_of_codes)
-  for (i=0;i<number_of_codes;i++)
-     WriteUnsignedInteger (codes[i])
+  WriteUnsignedIntegers (codes.data(), number_of_codes)
   const uint32_t number_of_texts=texts.size();
   WriteUnsignedInteger (number_of_texts)
   for (i=0;i<number_of_texts;i++)
@@ -0,0 +1,119 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+// Class lookup and threshold placement of the colour ramps.
+
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <prc/ColorRamp.hpp>
+
+#include "PRCtest.hpp"
+
+using pdal::ColorRamp;
+
+namespace
+{
+
+// Class of v by definition: the number of thresholds at or below it.
+uint16_t countBelow(const ColorRamp& ramp, double v)
+{
+    uint16_t cls = 0;
+    for (double t : ramp.thresholds())
+        cls += (t <= v);
+    return cls;
+}
+
+// The branchless search must agree with the definition for any class
+// count, including values right on a threshold.
+void testClassify()
+{
+    std::mt19937_64 rng(3);
+    std::uniform_real_distribution<double> value(-20.0, 120.0);
+    for (std::size_t n = 1; n <= 40; ++n)
+    {
+        ColorRamp ramp(ColorRamp::oranges(), n);
+        PRC_CHECK(ramp.size() == n);
+        ramp.setLinear(0.0, 100.0);
+        PRC_CHECK(ramp.thresholds().size() == n - 1);
+        for (int i = 0; i < 1000; ++i)
+        {
+            const double v = value(rng);
+            PRC_CHECK(ramp.classify(v) == countBelow(ramp, v));
+        }
+        for (double t : ramp.thresholds())
+        {
+            PRC_CHECK(ramp.classify(t) == countBelow(ramp, t));
+            PRC_CHECK(ramp.classify(std::nextafter(t, -1e9)) ==
+                countBelow(ramp, std::nextafter(t, -1e9)));
+        }
+    }
+}
+
+void testLinearAndSqrt()
+{
+    ColorRamp ramp(ColorRamp::blueGreen(), 4);
+    ramp.setLinear(0.0, 8.0);
+    PRC_CHECK(ramp.thresholds() == std::vector<double>({ 2.0, 4.0, 6.0 }));
+    PRC_CHECK(ramp.classify(-1.0) == 0);
+    PRC_CHECK(ramp.classify(2.0) == 1);
+    PRC_CHECK(ramp.classify(9.0) == 3);
+
+    ramp.setSqrt(0.0, 16.0);
+    PRC_CHECK(ramp.thresholds() == std::vector<double>({ 1.0, 4.0, 9.0 }));
+
+    ramp.translate(-1.0);
+    PRC_CHECK(ramp.thresholds() == std::vector<double>({ 0.0, 3.0, 8.0 }));
+
+    ramp.setSqrt(-16.0, 0.0);
+    PRC_CHECK(ramp.thresholds() == std::vector<double>({ -15.0, -12.0, -7.0 }));
+}
+
+// Equalized thresholds split the counted values into equal shares.
+void testEqualized()
+{
+    // Three quarters of the values in the lowest tenth of the range.
+    std::vector<uint64_t> hist(10, 100);
+    hist[0] = 2700;
+    ColorRamp ramp(ColorRamp::oranges(), 4);
+    ramp.setEqualized(hist, 0.0, 10.0);
+    PRC_CHECK(std::fabs(ramp.thresholds()[0] - 1.0 / 3) < 1e-9);
+    PRC_CHECK(std::fabs(ramp.thresholds()[1] - 2.0 / 3) < 1e-9);
+    PRC_CHECK(std::fabs(ramp.thresholds()[2] - 1.0) < 1e-9);
+
+    PRC_CHECK(ColorRamp::quantile(hist, 0.0, 10.0, 0.0) == 0.0);
+    PRC_CHECK(ColorRamp::quantile(hist, 0.0, 10.0, 1.0) == 10.0);
+    PRC_CHECK(ColorRamp::quantile(std::vector<uint64_t>(4, 0), 2.0, 3.0,
+        0.5) == 2.0);
+}
+
+// Classes that land on an anchor take its colour, and a ramp with as many
+// classes as anchors is the anchors.
+void testColours()
+{
+    const std::vector<RGBAColour> anchors = ColorRamp::oranges();
+    ColorRamp ramp(anchors, 17);
+    PRC_CHECK(ramp.colour(0) == anchors.front());
+    PRC_CHECK(ramp.colour(2) == anchors[1]);
+    PRC_CHECK(ColorRamp(anchors, 9).colours() == anchors);
+}
+
+} // unnamed namespace
+
+PRC_TEST_MAIN(testClassify, testLinearAndSqrt, testEqualized, testColours)
@@ -0,0 +1,88 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+// Level-of-detail assignment of the octree.
+
+#include <vector>
+
+#include <prc/OctreeBuilder.hpp>
+
+#include "PRCtest.hpp"
+
+using pdal::OctreeBuilder;
+
+namespace
+{
+
+// A point takes the coarsest level whose cell holding it is still empty, and
+// the last level takes the points that find none.
+void testLevels()
+{
+    const double min[3] = { 0.0, 0.0, 0.0 };
+    OctreeBuilder tree(min, 8.0, 3);
+    PRC_CHECK(tree.levels() == 3);
+
+    const double a[3] = { 1.0, 1.0, 1.0 };
+    const double b[3] = { 2.0, 2.0, 2.0 };
+    const double c[3] = { 5.0, 5.0, 5.0 };
+    const double d[3] = { 9.0, 1.0, 1.0 };
+    PRC_CHECK(tree.insert(a) == 0);
+    // Same cell as a at edge 8; a did not take its cell at edge 4.
+    PRC_CHECK(tree.insert(b) == 1);
+    PRC_CHECK(tree.insert(c) == 1);
+    PRC_CHECK(tree.insert(d) == 0);
+    // Both of its cells are taken, by a and b.
+    PRC_CHECK(tree.insert(a) == 2);
+}
+
+// Level k holds one point per cell of edge spacing / 2^k once the cloud is
+// dense enough to fill them.
+void testDensity()
+{
+    const double min[3] = { 0.0, 0.0, 0.0 };
+    OctreeBuilder tree(min, 1.0, 4);
+    std::vector<unsigned> counts(4, 0);
+    // A dense 16 x 16 x 16 lattice in the unit cube.
+    for (int x = 0; x < 16; ++x)
+        for (int y = 0; y < 16; ++y)
+            for (int z = 0; z < 16; ++z)
+            {
+                const double p[3] = { (x + 0.5) / 16, (y + 0.5) / 16,
+                    (z + 0.5) / 16 };
+                counts[tree.insert(p)]++;
+            }
+    PRC_CHECK(counts[0] == 1);
+    PRC_CHECK(counts[1] == 8);
+    PRC_CHECK(counts[2] == 64);
+    PRC_CHECK(counts[3] == 4096 - 1 - 8 - 64);
+}
+
+// With one level every point is at level 0.
+void testSingleLevel()
+{
+    const double min[3] = { -1.0, -1.0, -1.0 };
+    OctreeBuilder tree(min, 0.5, 0);
+    const double p[3] = { 0.0, 0.0, 0.0 };
+    PRC_CHECK(tree.levels() == 1);
+    PRC_CHECK(tree.insert(p) == 0);
+    PRC_CHECK(tree.insert(p) == 0);
+}
+
+} // unnamed namespace
+
+PRC_TEST_MAIN(testLevels, testDensity, testSingleLevel)
@@ -0,0 +1,144 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+// Every way PRC data is deflated must give a zlib stream that the library's
+// own uncompress() reads back to the input.
+
+#include <algorithm>
+#include <random>
+#include <stdlib.h>
+#include <vector>
+
+#include <prc/PRCbitStream.hpp>
+#include <prc/PRCdeflate.hpp>
+
+#include "PRCtest.hpp"
+
+namespace
+{
+
+// Compressible input that still has some entropy: runs of a few symbols
+// mixed with noise.
+std::vector<uint8_t> makeInput(size_t size)
+{
+    std::mt19937_64 rng(7);
+    std::vector<uint8_t> input(size);
+    for (size_t i = 0; i < size; ++i)
+        input[i] = (rng() % 4 == 0) ? static_cast<uint8_t>(rng()) :
+            static_cast<uint8_t>((i / 64) % 16);
+    return input;
+}
+
+bool roundTrips(const std::vector<uint8_t>& input, const uint8_t *compressed,
+    size_t compressedSize)
+{
+    std::vector<uint8_t> inflated;
+    return compressed != NULL &&
+        prcInflate(compressed, compressedSize, input.size() + 1, inflated) &&
+        inflated == input;
+}
+
+// One thread, and several threads over inputs that end inside, at and just
+// past a block boundary.
+void testDeflate()
+{
+    const size_t sizes[] = { 0, 1, 1000, PRC_DEFLATE_BLOCK,
+        PRC_DEFLATE_BLOCK + 1, 3 * PRC_DEFLATE_BLOCK,
+        5 * PRC_DEFLATE_BLOCK / 2 };
+    const unsigned threads[] = { 1, 2, 4 };
+    const int levels[] = { PRC_DEFAULT_COMPRESSION, 1, 9 };
+    for (size_t size : sizes)
+    {
+        const std::vector<uint8_t> input = makeInput(size);
+        for (unsigned n : threads)
+            for (int level : levels)
+            {
+                size_t compressedSize = 0;
+                uint8_t *compressed = PRCDeflate(input.data(), input.size(),
+                    level, compressedSize, n);
+                PRC_CHECK(roundTrips(input, compressed, compressedSize));
+                free(compressed);
+            }
+    }
+}
+
+// A stream fed in uneven pieces gives the same bytes as one call.
+void testDeflateStream()
+{
+    if (!PRCDeflateStream::available())
+        return;
+    const std::vector<uint8_t> input = makeInput(3 * PRC_DEFLATE_BLOCK);
+    PRCDeflateStream stream(PRC_DEFAULT_COMPRESSION);
+    size_t pos = 0;
+    for (size_t piece = 1; pos < input.size(); piece = piece * 3 + 1)
+    {
+        const size_t n = std::min(piece, input.size() - pos);
+        stream.write(input.data() + pos, n, false);
+        pos += n;
+    }
+    stream.write(NULL, 0, true);
+    size_t compressedSize = 0;
+    uint8_t *compressed = stream.release(compressedSize);
+    PRC_CHECK(roundTrips(input, compressed, compressedSize));
+
+    size_t oneShotSize = 0;
+    uint8_t *oneShot = PRCDeflate(input.data(), input.size(),
+        PRC_DEFAULT_COMPRESSION, oneShotSize);
+    PRC_CHECK(oneShot != NULL && oneShotSize == compressedSize &&
+        std::equal(oneShot, oneShot + oneShotSize, compressed));
+    free(compressed);
+    free(oneShot);
+}
+
+// A bit stream compressed after it is written, in parallel blocks, and
+// while it is written must all hold the same bytes.
+void testBitStream()
+{
+    std::vector<double> values;
+    std::mt19937_64 rng(11);
+    for (int i = 0; i < 300000; ++i)
+        values.push_back(static_cast<double>(rng() % 100000) / 100);
+
+    std::vector<uint8_t> raw;
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        uint8_t *data = NULL;
+        {
+            PRCbitStream out(data, 0);
+            if (mode == 1)
+                out.setCompressionThreads(4);
+            if (mode == 2)
+                out.enableStreamingCompression();
+            out.writeDoubles(values.data(), values.size());
+            out << std::string("end");
+            if (mode == 0)
+                raw.assign(out.getData(), out.getData() + out.getSize());
+            out.compress();
+
+            std::vector<uint8_t> inflated;
+            PRC_CHECK(prcInflate(data, out.getSize(), raw.size() + 1,
+                inflated));
+            PRC_CHECK(inflated == raw);
+        }
+        free(data);
+    }
+}
+
+} // unnamed namespace
+
+PRC_TEST_MAIN(testDeflate, testDeflateStream, testBitStream)
@@ -0,0 +1,86 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+#pragma once
+
+// Checks shared by the tests of the PRC code.  They build without PDAL and
+// without a test framework: each test is a function, PRC_CHECK reports a
+// failed condition and carries on, and PRC_TEST_MAIN runs the tests and
+// fails if any check did.
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#if defined(PRC_WITH_LIBDEFLATE)
+#include <libdeflate.h>
+#elif defined(PRC_WITH_ZLIB_NG)
+#include <zlib-ng.h>
+#else
+#include <zlib.h>
+#endif
+
+inline unsigned& prcTestFailures()
+{
+    static unsigned failures = 0;
+    return failures;
+}
+
+#define PRC_CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                #cond); \
+            prcTestFailures()++; \
+        } \
+    } while (0)
+
+#define PRC_TEST_MAIN(...) \
+    int main() \
+    { \
+        void (*tests[])() = { __VA_ARGS__ }; \
+        for (auto test : tests) \
+            test(); \
+        if (prcTestFailures()) \
+            fprintf(stderr, "%u checks failed\n", prcTestFailures()); \
+        return prcTestFailures() ? 1 : 0; \
+    }
+
+// Inflate the zlib stream in[0, size) with the library's one-shot
+// uncompress, independently of PRCDeflate().  maxSize bounds the result.
+inline bool prcInflate(const uint8_t *in, size_t size, size_t maxSize,
+    std::vector<uint8_t>& out)
+{
+    out.resize(maxSize);
+#if defined(PRC_WITH_LIBDEFLATE)
+    struct libdeflate_decompressor *d = libdeflate_alloc_decompressor();
+    size_t length = 0;
+    const bool ok = d != NULL && libdeflate_zlib_decompress(d, in, size,
+        out.data(), out.size(), &length) == LIBDEFLATE_SUCCESS;
+    libdeflate_free_decompressor(d);
+#elif defined(PRC_WITH_ZLIB_NG)
+    size_t length = out.size();
+    const bool ok = zng_uncompress(out.data(), &length, in, size) == Z_OK;
+#else
+    uLongf length = out.size();
+    const bool ok = uncompress(out.data(), &length, in, size) == Z_OK;
+#endif
+    out.resize(ok ? length : 0);
+    return ok;
+}
@@ -0,0 +1,47 @@
+# Run a pipeline through pdal with the plugin and compare the counts that
+# writers.prc reports in its metadata with the expected ones.
+#
+#   cmake -DPDAL=<pdal> -DDRIVER_PATH=<plugin dir> -DPIPELINE=<json>
+#         -DOUTPUT=<prefix> -DGROUP_COUNT=<n> -DPOINT_SET_COUNT=<n>
+#         -DPOINT_COUNT=<n> [-DSTREAM=ON|ONLY] -P check_pipeline.cmake
+#
+# With STREAM=ON the pipeline is run in streaming mode as well, and must give
+# the same counts.  STREAM=ONLY runs it in streaming mode alone, for options
+# that only change how a stream is written.
+
+set(ENV{PDAL_DRIVER_PATH} "${DRIVER_PATH}")
+get_filename_component(dir "${PIPELINE}" DIRECTORY)
+
+if(STREAM STREQUAL "ONLY")
+  set(modes stream)
+elseif(STREAM)
+  set(modes standard stream)
+else()
+  set(modes standard)
+endif()
+
+foreach(mode ${modes})
+  set(args pipeline "${PIPELINE}" --metadata "${OUTPUT}_${mode}.json"
+    "--writers.prc.filename=${OUTPUT}_${mode}.prc")
+  if(mode STREQUAL "stream")
+    list(APPEND args --stream)
+  endif()
+  execute_process(COMMAND "${PDAL}" ${args}
+    WORKING_DIRECTORY "${dir}"
+    RESULT_VARIABLE result)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "pdal ${args} failed: ${result}")
+  endif()
+
+  file(READ "${OUTPUT}_${mode}.json" metadata)
+  foreach(count group_count point_set_count point_count)
+    string(TOUPPER ${count} var)
+    string(REGEX MATCH "\"${count}\": *\"?([0-9]+)" found "${metadata}")
+    if(NOT found)
+      message(SEND_ERROR "${mode}: no ${count} in the metadata")
+    elseif(NOT CMAKE_MATCH_1 EQUAL ${var})
+      message(SEND_ERROR
+        "${mode}: ${count} is ${CMAKE_MATCH_1}, expected ${${var}}")
+    endif()
+  endforeach()
+endforeach()
@@ -0,0 +1,323 @@
+/******************************************************************************
+* This file is part of a tool for producing 3D content in the PRC format.
+* Copyright (c) 2013-2015, Bradley J Chambers, brad.chambers@gmail.com
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this program.  If not, see <http://www.gnu.org/licenses/>.
+****************************************************************************/
+
+// Files written through oPRCFile with different threads and memory options
+// must hold the same model.
+
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <prc/oPRCFile.hpp>
+#include <prc/PRCdeflate.hpp>
+
+#include "PRCtest.hpp"
+
+namespace
+{
+
+// Bytes of the PRC header before the file structure UUID, and where the
+// six section offsets of the first file structure start.
+const size_t HeaderUuidOffset = 3 + 2 * 4;
+const size_t SectionOffsets = HeaderUuidOffset + 2 * 16 + 4 + 16 + 2 * 4;
+
+struct Scene
+{
+    // Interleaved XYZ, pointsPerColor points of each colour in turn.
+    std::vector<double> xyz;
+    std::vector<RGBAColour> palette;
+    uint32_t pointsPerColor;
+    // A grid of gridSize by gridSize vertices, or none.
+    uint32_t gridSize;
+};
+
+struct Options
+{
+    Options() : threads(1), memoryLimit(0), streaming(false),
+        spillPoints(false) {}
+
+    unsigned threads;
+    uint64_t memoryLimit;
+    bool streaming;
+    // Spill the point sets once they are all added, whatever the limit.
+    bool spillPoints;
+};
+
+struct Output
+{
+    std::string bytes;
+    // Compressed section sizes, and the point sets spilled by the time the
+    // last was added.
+    struct
+    {
+        uint32_t sizes[6];
+        uint32_t spilledSets;
+    } info;
+};
+
+Scene makeScene(uint32_t numPoints, uint32_t numColors, uint32_t gridSize)
+{
+    Scene scene;
+    std::mt19937_64 rng(42);
+    std::uniform_real_distribution<double> coord(-100.0, 100.0);
+    scene.pointsPerColor = numPoints / numColors;
+    for (uint32_t k = 0; k < numColors; ++k)
+        scene.palette.push_back(RGBAColour(k / double(numColors), 0.5,
+            1.0 - k / double(numColors), 1.0));
+    // Coordinates on a 1/100 grid, as a scanner's would be.
+    for (uint32_t i = 0; i < scene.pointsPerColor * numColors; ++i)
+        for (int axis = 0; axis < 3; ++axis)
+            scene.xyz.push_back(std::round(coord(rng) * 100) / 100);
+    scene.gridSize = gridSize;
+    return scene;
+}
+
+void writeScene(const Scene& scene, const Options& opts, Output& output)
+{
+    std::ostringstream out;
+    {
+        oPRCFile prc(out, 1000);
+        // The header's own UUID is made from the time; the file structure's
+        // is fixed so that files written apart can be compared.
+        PRCUniqueId& uuid = prc.fileStructures[0]->file_structure_uuid;
+        uuid.id0 = uuid.id1 = uuid.id2 = uuid.id3 = 1;
+        prc.setThreads(opts.threads);
+        prc.setMemoryLimit(opts.memoryLimit);
+        if (opts.streaming)
+            prc.enableStreamingCompression();
+
+        prc.begingroup("points");
+        for (size_t k = 0; k < scene.palette.size(); ++k)
+            prc.addPoints(scene.pointsPerColor,
+                scene.xyz.data() + 3 * k * scene.pointsPerColor,
+                scene.palette[k], 1.0);
+        if (opts.spillPoints)
+            prc.spillPointSets();
+        output.info.spilledSets = 0;
+        for (PRCPointSet *pointset : prc.groups.top().pointsets)
+            output.info.spilledSets += pointset->spill_file != NULL;
+        prc.endgroup();
+
+        if (scene.gridSize > 1)
+        {
+            const uint32_t n = scene.gridSize;
+            std::vector<double> vertices;
+            std::vector<uint32_t> triangles;
+            for (uint32_t y = 0; y < n; ++y)
+                for (uint32_t x = 0; x < n; ++x)
+                {
+                    vertices.push_back(x);
+                    vertices.push_back(y);
+                    vertices.push_back((x * y) % 7);
+                }
+            for (uint32_t y = 0; y + 1 < n; ++y)
+                for (uint32_t x = 0; x + 1 < n; ++x)
+                {
+                    const uint32_t v = y * n + x;
+                    const uint32_t quad[6] = { v, v + 1, v + n,
+                        v + 1, v + n + 1, v + n };
+                    triangles.insert(triangles.end(), quad, quad + 6);
+                }
+            PRCmaterial material(RGBAColour(0.1, 0.1, 0.1),
+                RGBAColour(1.0, 1.0, 1.0), RGBAColour(0.0, 0.0, 0.0),
+                RGBAColour(0.1, 0.1, 0.1), 1.0, 0.1);
+            prc.begingroup("mesh");
+            prc.addTriangles(n * n,
+                reinterpret_cast<const double (*)[3]>(vertices.data()),
+                static_cast<uint32_t>(triangles.size() / 3),
+                reinterpret_cast<const uint32_t (*)[3]>(triangles.data()),
+                material, 0, NULL, NULL, 0, NULL, NULL, 0, NULL, NULL,
+                0, NULL, NULL, 25.8419);
+            prc.endgroup();
+        }
+
+        prc.finish();
+        std::memcpy(output.info.sizes, prc.fileStructures[0]->sizes,
+            sizeof(output.info.sizes));
+    }
+    output.bytes = out.str();
+}
+
+// Write the scene in a child process.  Entity IDs come from counters that
+// last for the whole process, so only files written first in their process
+// can be compared.
+Output writeScene(const Scene& scene, const Options& opts)
+{
+    Output output = Output();
+    int fds[2];
+    if (pipe(fds) != 0)
+        return output;
+    const pid_t pid = fork();
+    if (pid == 0)
+    {
+        close(fds[0]);
+        writeScene(scene, opts, output);
+        bool ok = write(fds[1], &output.info, sizeof(output.info)) ==
+            sizeof(output.info);
+        for (size_t pos = 0; ok && pos < output.bytes.size();)
+        {
+            const ssize_t n = write(fds[1], output.bytes.data() + pos,
+                output.bytes.size() - pos);
+            ok = n > 0;
+            pos += ok ? n : 0;
+        }
+        _exit(ok ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string received;
+    char buffer[65536];
+    for (ssize_t n; (n = read(fds[0], buffer, sizeof(buffer))) > 0;)
+        received.append(buffer, n);
+    close(fds[0]);
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            received.size() < sizeof(output.info))
+        return output;
+    std::memcpy(&output.info, received.data(), sizeof(output.info));
+    output.bytes = received.substr(sizeof(output.info));
+    return output;
+}
+
+// Files are the same but for the UUID in the header.
+bool sameFile(const Output& a, const Output& b)
+{
+    if (a.bytes.size() != b.bytes.size() ||
+            a.bytes.size() < HeaderUuidOffset + 16)
+        return false;
+    return a.bytes.compare(0, HeaderUuidOffset, b.bytes, 0,
+            HeaderUuidOffset) == 0 &&
+        a.bytes.compare(HeaderUuidOffset + 16, std::string::npos, b.bytes,
+            HeaderUuidOffset + 16, std::string::npos) == 0;
+}
+
+// Inflated bytes of a section, 1 to 5, of the first file structure.
+std::vector<uint8_t> section(const Output& output, int index)
+{
+    std::vector<uint8_t> inflated;
+    if (output.bytes.size() < SectionOffsets + 6 * 4)
+        return inflated;
+    uint32_t offset;
+    std::memcpy(&offset, output.bytes.data() + SectionOffsets + 4 * index,
+        sizeof(offset));
+    const uint32_t size = output.info.sizes[index];
+    if (offset + size > output.bytes.size())
+        return inflated;
+    prcInflate(reinterpret_cast<const uint8_t*>(output.bytes.data()) + offset,
+        size, 64 * size + (1 << 20), inflated);
+    return inflated;
+}
+
+// The sections are serialized in a different order, and on other threads,
+// when there are workers.  With every section below the block size the file
+// must not change.
+void testThreadsKeepBytes()
+{
+    Scene scene = makeScene(2000, 4, 16);
+    Options opts;
+    const Output one = writeScene(scene, opts);
+    for (unsigned threads = 2; threads <= 8; threads *= 2)
+    {
+        opts.threads = threads;
+        PRC_CHECK(sameFile(one, writeScene(scene, opts)));
+    }
+}
+
+// At four threads the large tree section, which holds the points, must be
+// deflated in parallel blocks: its compressed bytes change, but it inflates
+// to the same section.
+void testBlockDeflateAtFourThreads()
+{
+    Scene scene = makeScene(200000, 4, 0);
+    Options opts;
+    const Output one = writeScene(scene, opts);
+    opts.threads = 4;
+    const Output four = writeScene(scene, opts);
+
+    const std::vector<uint8_t> tree = section(one, 2);
+    PRC_CHECK(tree.size() > PRC_DEFLATE_BLOCK);
+    PRC_CHECK(four.info.sizes[2] != one.info.sizes[2]);
+    PRC_CHECK(section(four, 2) == tree);
+    for (int index = 1; index < 6; ++index)
+        if (index != 2)
+            PRC_CHECK(section(four, index) == section(one, index));
+}
+
+// Point sets spilled to the temporary file past memory_limit are read back
+// when the tree is serialized, so the file must not change.
+void testSpillKeepsBytes()
+{
+    Scene scene = makeScene(40000, 8, 16);
+    Options opts;
+    const Output resident = writeScene(scene, opts);
+    PRC_CHECK(resident.info.spilledSets == 0);
+    opts.memoryLimit = 64 * 1024;
+    Output spilled = writeScene(scene, opts);
+    PRC_CHECK(spilled.info.spilledSets > 0);
+    PRC_CHECK(sameFile(resident, spilled));
+    opts.streaming = true;
+    opts.threads = 4;
+    spilled = writeScene(scene, opts);
+    PRC_CHECK(spilled.info.spilledSets > 0);
+    PRC_CHECK(sameFile(resident, spilled));
+}
+
+// Point sets spilled on request, as each tile is by the writer, are all
+// spilled if there is a limit, and the file does not change.
+void testSpillOnRequest()
+{
+    Scene scene = makeScene(4000, 8, 0);
+    Options opts;
+    const Output resident = writeScene(scene, opts);
+    opts.spillPoints = true;
+    Output spilled = writeScene(scene, opts);
+    PRC_CHECK(spilled.info.spilledSets == 0);
+    PRC_CHECK(sameFile(resident, spilled));
+    opts.memoryLimit = uint64_t(1) << 40;
+    spilled = writeScene(scene, opts);
+    PRC_CHECK(spilled.info.spilledSets == scene.palette.size());
+    PRC_CHECK(sameFile(resident, spilled));
+}
+
+// A point set that cannot be written to the spill file keeps its points.
+void testFailedSpillKeepsPoints()
+{
+    FILE *readOnly = fopen("/dev/null", "r");
+    PRC_CHECK(readOnly != NULL);
+    if (readOnly == NULL)
+        return;
+    PRCPointSet pointset;
+    for (int i = 0; i < 10000; ++i)
+        pointset.point.push_back(PRCVector3d(i, 2 * i, 3 * i));
+    PRC_CHECK(!pointset.spill(readOnly));
+    PRC_CHECK(pointset.point.size() == 10000);
+    PRC_CHECK(pointset.spill_file == NULL);
+    PRC_CHECK(pointset.spill_count == 0);
+    fclose(readOnly);
+}
+
+} // unnamed namespace
+
+PRC_TEST_MAIN(testThreadsKeepBytes, testBlockDeflateAtFourThreads,
+    testSpillKeepsBytes, testSpillOnRequest, testFailedSpillKeepsPoints)